@@ -0,0 +1,98 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include "hashes.h"
+
+using namespace std;
+
+// Point IDs per chunk of a bucket, a cache line of them
+constexpr uint32_t BUCKET_CHUNK = 16;
+constexpr uint32_t NO_CHUNK = UINT32_MAX;
+
+// Point IDs of one bucket: a list of chunks of a BucketArena, the partly filled chunk first
+struct Bucket {
+  uint32_t first = NO_CHUNK;
+  uint32_t size = 0;
+};
+
+// Storage of the point IDs of all the buckets of a hash table, in chunks of BUCKET_CHUNK IDs carved from one pool
+// instead of a vector per bucket. The pool grows geometrically and chunks freed by removals are reused, so a table
+// allocates a handful of times over its whole life rather than several times per bucket, and not at all once the
+// pool has reached the size the table needs, as in a full sliding window
+class BucketArena {
+private:
+  vector<uint32_t> ids;
+  // Next chunk of every chunk in its bucket, or in the list of free chunks
+  vector<uint32_t> next;
+  uint32_t freeChunks = NO_CHUNK;
+
+  uint32_t allocate() {
+    if (freeChunks != NO_CHUNK) {
+      uint32_t chunk = freeChunks;
+      freeChunks = next[chunk];
+      return chunk;
+    }
+    uint32_t chunk = (uint32_t) next.size();
+    next.push_back(NO_CHUNK);
+    ids.resize(ids.size() + BUCKET_CHUNK);
+    return chunk;
+  }
+
+  uint32_t *last(const Bucket &bucket) {
+    return ids.data() + (size_t) bucket.first * BUCKET_CHUNK + (bucket.size - 1) % BUCKET_CHUNK;
+  }
+
+public:
+  void add(Bucket &bucket, uint32_t id) {
+    if (bucket.size % BUCKET_CHUNK == 0) {
+      uint32_t chunk = allocate();
+      next[chunk] = bucket.first;
+      bucket.first = chunk;
+    }
+    bucket.size++;
+    *last(bucket) = id;
+  }
+
+  // Removes an ID of the bucket, the ID added last taking its place
+  void remove(Bucket &bucket, uint32_t id) {
+    uint32_t count = (bucket.size - 1) % BUCKET_CHUNK + 1;
+    for (uint32_t chunk = bucket.first; chunk != NO_CHUNK; chunk = next[chunk], count = BUCKET_CHUNK) {
+      uint32_t *chunkIds = ids.data() + (size_t) chunk * BUCKET_CHUNK;
+      uint32_t i = 0;
+      while (i < count && chunkIds[i] != id) {
+        ++i;
+      }
+      if (i < count) {
+        chunkIds[i] = *last(bucket);
+        break;
+      }
+    }
+    bucket.size--;
+    if (bucket.size % BUCKET_CHUNK == 0) {
+      uint32_t chunk = bucket.first;
+      bucket.first = next[chunk];
+      next[chunk] = freeChunks;
+      freeChunks = chunk;
+    }
+  }
+
+  // Calls fn(id) for every ID of the bucket
+  template <typename Fn>
+  void forEach(const Bucket &bucket, Fn fn) const {
+    if (bucket.size == 0) {
+      return;
+    }
+    uint32_t count = (bucket.size - 1) % BUCKET_CHUNK + 1;
+    for (uint32_t chunk = bucket.first; chunk != NO_CHUNK; chunk = next[chunk], count = BUCKET_CHUNK) {
+      const uint32_t *chunkIds = ids.data() + (size_t) chunk * BUCKET_CHUNK;
+      for (uint32_t i = 0; i < count; ++i) {
+        fn(chunkIds[i]);
+      }
+    }
+  }
+
+  size_t bytes() const {
+    return ids.capacity() * sizeof(uint32_t) + next.capacity() * sizeof(uint32_t);
+  }
+};
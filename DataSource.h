@@ -0,0 +1,221 @@
+#pragma once
+
+#include <charconv>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "hashes.h"
+#include "ModelFile.h"
+
+using namespace std;
+
+// Source of training points, read in chunks of row-major points so the data never has to fit in memory at once
+template <typename Real = ld>
+class DataSource {
+public:
+  virtual ~DataSource() = default;
+
+  // Number of coordinates of each point, known once the first point has been read
+  virtual ll dim() const = 0;
+
+  // Replaces rows with up to maxRows more points, row-major, and returns how many were read (0 at the end)
+  virtual ll next(vector<Real> &rows, ll maxRows) = 0;
+
+  // Starts reading again from the first point
+  virtual void rewind() = 0;
+
+  // Set when the input is malformed; reading stops at the offending row
+  virtual bool failed() const = 0;
+  virtual const string &error() const = 0;
+};
+
+// Reads points from a text file with one point per line and coordinates separated by commas, as in points.txt
+// The file is read in blocks of BLOCK_BYTES and numbers are parsed with from_chars
+template <typename Real = ld>
+class CsvSource : public DataSource<Real> {
+private:
+  static constexpr size_t BLOCK_BYTES = 1 << 20;
+
+  string path;
+  bool header;
+  ifstream file;
+
+  // Bytes read from the file not parsed yet
+  vector<char> buffer;
+  size_t begin = 0, end = 0;
+  bool eof = false;
+
+  ll DIM = 0;
+  ll line = 0;
+  string message;
+
+  // Reads the next block of the file after the unparsed bytes
+  bool fill() {
+    if (eof) {
+      return false;
+    }
+    buffer.erase(buffer.begin(), buffer.begin() + begin);
+    end -= begin;
+    begin = 0;
+    buffer.resize(end + BLOCK_BYTES);
+    file.read(buffer.data() + end, BLOCK_BYTES);
+    end += file.gcount();
+    eof = file.gcount() < (streamsize) BLOCK_BYTES;
+    return true;
+  }
+
+  // Parses the coordinates of one line, appending them to rows; returns the number of coordinates or -1
+  ll parseLine(const char *first, const char *last, vector<Real> &rows) {
+    ll columns = 0;
+    const char *p = first;
+    while (true) {
+      while (p < last && (*p == ' ' || *p == '\t')) {
+        ++p;
+      }
+      Real value;
+      auto result = from_chars(p, last, value);
+      if (result.ec != errc()) {
+        return -1;
+      }
+      rows.push_back(value);
+      ++columns;
+      p = result.ptr;
+      while (p < last && (*p == ' ' || *p == '\t' || *p == '\r')) {
+        ++p;
+      }
+      if (p == last) {
+        return columns;
+      }
+      if (*p != ',') {
+        return -1;
+      }
+      ++p;
+    }
+  }
+
+public:
+  explicit CsvSource(const string &path, bool header = false) : path(path), header(header) {
+    rewind();
+  }
+
+  ll dim() const override {
+    return DIM;
+  }
+
+  bool failed() const override {
+    return !message.empty();
+  }
+
+  const string &error() const override {
+    return message;
+  }
+
+  void rewind() override {
+    message.clear();
+    file.close();
+    file.clear();
+    file.open(path, ios::binary);
+    if (!file.is_open()) {
+      message = "cannot open " + path;
+    }
+    buffer.clear();
+    begin = end = 0;
+    eof = !file.is_open();
+    line = 0;
+  }
+
+  ll next(vector<Real> &rows, ll maxRows) override {
+    rows.clear();
+    ll count = 0;
+    while (count < maxRows && !failed()) {
+      const char *first = buffer.data() + begin;
+      const char *newline = static_cast<const char *>(memchr(first, '\n', end - begin));
+      if (newline == nullptr) {
+        if (fill()) {
+          continue;
+        }
+        if (begin == end) {
+          break;
+        }
+        // Last line without a line break
+        newline = buffer.data() + end;
+      }
+
+      const char *last = newline;
+      size_t consumed = newline - first + (newline < buffer.data() + end ? 1 : 0);
+      ++line;
+      bool blank = all_of(first, last, [](char c) { return c == ' ' || c == '\t' || c == '\r'; });
+      if (!blank && !(header && line == 1)) {
+        ll columns = parseLine(first, last, rows);
+        if (columns < 0 || (DIM > 0 && columns != DIM)) {
+          message = path + ":" + to_string(line) + ": malformed row";
+          rows.resize(count * DIM);
+          break;
+        }
+        DIM = columns;
+        ++count;
+      }
+      begin += consumed;
+    }
+    return count;
+  }
+};
+
+// Reads points from a raw little-endian matrix of n x dim values of type Elem, with no header, mapped into memory
+template <typename Real = ld, typename Elem = double>
+class BinaryMatrixSource : public DataSource<Real> {
+private:
+  ModelBuffer mapping;
+  ll DIM;
+  ll rows = 0;
+  ll position = 0;
+  string path;
+  string message;
+
+  // Sets the error if the file could not be mapped or does not hold whole rows
+  void check() {
+    if (DIM <= 0) {
+      message = path + ": dim must be positive";
+    } else if (mapping.empty()) {
+      message = "cannot map " + path;
+    } else if (mapping.size() % (DIM * sizeof(Elem)) != 0) {
+      message = path + ": size is not a multiple of the row size";
+    }
+  }
+
+public:
+  BinaryMatrixSource(const string &path, ll dim) : DIM(dim), path(path) {
+    mapping = ModelBuffer::map(path);
+    check();
+    if (!failed()) {
+      rows = (ll) (mapping.size() / (DIM * sizeof(Elem)));
+      madvise(mapping.data(), mapping.size(), MADV_SEQUENTIAL);
+    }
+  }
+
+  ll dim() const override {
+    return DIM;
+  }
+
+  bool failed() const override {
+    return !message.empty();
+  }
+
+  const string &error() const override {
+    return message;
+  }
+
+  void rewind() override {
+    message.clear();
+    check();
+    position = 0;
+  }
+
+  ll next(vector<Real> &out, ll maxRows) override {
+    ll count = failed() ? 0 : min(maxRows, rows - position);
+    const Elem *values = reinterpret_cast<const Elem *>(mapping.data()) + position * DIM;
+    out.assign(values, values + count * DIM);
+    position += count;
+    return count;
+  }
+};
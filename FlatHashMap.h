@@ -0,0 +1,231 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include "hashes.h"
+
+using namespace std;
+
+// 64-bit fingerprint of a hash value made of L integers
+// With FixedL, L is known at compile time and the loop unrolled; both give the same fingerprint
+template <ll FixedL = 0>
+inline uint64_t fingerprint(const ll *key, ll L = FixedL) {
+  if constexpr (FixedL > 0) {
+    L = FixedL;
+  }
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ (uint64_t) L;
+  for (ll l = 0; l < L; ++l) {
+    h ^= (uint64_t) key[l] + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+  }
+  return h;
+}
+
+// Slot of a FlatHashMap: the fingerprint of a key, the ID of its entry and its distance to its home slot
+struct FlatSlot {
+  uint64_t fingerprint;
+  uint32_t entry;
+  uint32_t distance;
+};
+
+constexpr uint32_t FLAT_EMPTY = UINT32_MAX;
+
+// Read-only view of the arrays of a FlatHashMap, which may live in the map itself or in a mapped model file
+template <typename V>
+struct FlatHashMapView {
+  const FlatSlot *slots;
+  uint64_t slotCount;
+  const ll *keys;
+  const V *values;
+  ll size;
+  ll L;
+
+  // Returns the entry ID of the key, or -1 if the key is not in the map
+  // FixedL, when it is L, makes the length of the keys a compile-time constant so the comparison is inlined
+  template <ll FixedL = 0>
+  ll find(const ll *key, uint64_t fp) const {
+    if (slotCount == 0) {
+      return -1;
+    }
+    const ll length = FixedL > 0 ? FixedL : L;
+    uint64_t mask = slotCount - 1;
+    uint64_t pos = fp & mask;
+    for (uint32_t distance = 0; slots[pos].entry != FLAT_EMPTY && slots[pos].distance >= distance; ++distance) {
+      if (slots[pos].fingerprint == fp &&
+          memcmp(keys + (size_t) slots[pos].entry * length, key, length * sizeof(ll)) == 0) {
+        return slots[pos].entry;
+      }
+      pos = (pos + 1) & mask;
+    }
+    return -1;
+  }
+
+  template <ll FixedL = 0>
+  ll find(const ll *key) const {
+    return find<FixedL>(key, fingerprint<FixedL>(key, L));
+  }
+
+  const V &value(uint32_t entry) const {
+    return values[entry];
+  }
+};
+
+// Open-addressing hash map (Robin Hood probing) from a hash value of L integers to a value of type V
+// Entries are numbered densely in insertion order, so an entry ID can be used as a bucket ID
+// Slots only hold the 64-bit fingerprint of the key, the full key is compared on a fingerprint match
+template <typename V>
+class FlatHashMap {
+private:
+  using Slot = FlatSlot;
+  static constexpr uint32_t EMPTY = FLAT_EMPTY;
+
+  // Power of two number of slots
+  vector<Slot> slots;
+  uint64_t mask = 0;
+
+  // Keys of the entries, L integers per entry, and their values
+  vector<ll> keys;
+  vector<V> values;
+
+  ll L;
+
+  // Places an entry in the slots, displacing entries closer to their home slot
+  void place(Slot slot) {
+    uint64_t pos = slot.fingerprint & mask;
+    while (slots[pos].entry != EMPTY) {
+      if (slots[pos].distance < slot.distance) {
+        swap(slots[pos], slot);
+      }
+      pos = (pos + 1) & mask;
+      ++slot.distance;
+    }
+    slots[pos] = slot;
+  }
+
+  void grow() {
+    vector<Slot> old = move(slots);
+    slots.assign(old.empty() ? 16 : old.size() * 2, {0, EMPTY, 0});
+    mask = slots.size() - 1;
+    for (const auto &slot : old) {
+      if (slot.entry != EMPTY) {
+        place({slot.fingerprint, slot.entry, 0});
+      }
+    }
+  }
+
+  ll findEntry(const ll *key, uint64_t fp) const {
+    return view().find(key, fp);
+  }
+
+public:
+  explicit FlatHashMap(ll L = 0) : L(L) {}
+
+  ll size() const {
+    return (ll) values.size();
+  }
+
+  FlatHashMapView<V> view() const {
+    return {slots.data(), (uint64_t) slots.size(), keys.data(), values.data(), size(), L};
+  }
+
+  ll keyLength() const {
+    return L;
+  }
+
+  // Bytes held by the slots, keys and values, not counting memory owned by the values
+  size_t bytes() const {
+    return slots.capacity() * sizeof(Slot) + keys.capacity() * sizeof(ll) + values.capacity() * sizeof(V);
+  }
+
+  void reserve(ll n) {
+    keys.reserve(n * L);
+    values.reserve(n);
+    while ((ll) slots.size() * 3 < n * 4) {
+      grow();
+    }
+  }
+
+  // Returns the entry ID of the key, or -1 if the key is not in the map
+  ll find(const ll *key) const {
+    return findEntry(key, fingerprint(key, L));
+  }
+
+  ll find(const InnerHash &key) const {
+    return find(key.data());
+  }
+
+  // Returns the entry ID of the key, inserting it with a default value if it is not in the map
+  uint32_t insert(const ll *key) {
+    uint64_t fp = fingerprint(key, L);
+    ll entry = findEntry(key, fp);
+    if (entry >= 0) {
+      return (uint32_t) entry;
+    }
+
+    if ((size() + 1) * 4 > (ll) slots.size() * 3) {
+      grow();
+    }
+    uint32_t id = (uint32_t) size();
+    keys.insert(keys.end(), key, key + L);
+    values.emplace_back();
+    place({fp, id, 0});
+    return id;
+  }
+
+  uint32_t insert(const InnerHash &key) {
+    return insert(key.data());
+  }
+
+  // Removes the entry with the given ID, the last entry taking its ID
+  void erase(uint32_t entry) {
+    // Backward shift deletion: the entries following the erased one move one slot closer to their home slot
+    uint64_t pos = fingerprint(key(entry), L) & mask;
+    while (slots[pos].entry != entry) {
+      pos = (pos + 1) & mask;
+    }
+    uint64_t next = (pos + 1) & mask;
+    while (slots[next].entry != EMPTY && slots[next].distance > 0) {
+      slots[pos] = slots[next];
+      --slots[pos].distance;
+      pos = next;
+      next = (next + 1) & mask;
+    }
+    slots[pos] = {0, EMPTY, 0};
+
+    uint32_t last = (uint32_t) size() - 1;
+    if (entry != last) {
+      memcpy(keys.data() + (size_t) entry * L, key(last), L * sizeof(ll));
+      values[entry] = move(values[last]);
+      pos = fingerprint(key(entry), L) & mask;
+      while (slots[pos].entry != last) {
+        pos = (pos + 1) & mask;
+      }
+      slots[pos].entry = entry;
+    }
+    keys.resize((size_t) last * L);
+    values.pop_back();
+  }
+
+  V &operator[](const InnerHash &key) {
+    return values[insert(key)];
+  }
+
+  // Key of the entry with the given ID, L integers
+  const ll *key(uint32_t entry) const {
+    return keys.data() + (size_t) entry * L;
+  }
+
+  InnerHash keyVector(uint32_t entry) const {
+    return InnerHash(key(entry), key(entry) + L);
+  }
+
+  V &value(uint32_t entry) {
+    return values[entry];
+  }
+
+  const V &value(uint32_t entry) const {
+    return values[entry];
+  }
+};
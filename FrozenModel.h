@@ -0,0 +1,421 @@
+#pragma once
+
+#include <cassert>
+#include <fstream>
+#include "HashTables2.h"
+#include "ModelFile.h"
+
+using namespace std;
+
+// Immutable snapshot of a trained LSHAD model, holding only what scoring needs
+// Nothing is modified after construction, so any number of threads can score against it without locks
+// The model always lives in the binary model format (ModelFile.h), either in memory or mapped from a file, and
+// scoring reads the projections, tables and estimators in place
+template <typename Real = ld>
+class FrozenLSHADModel {
+public:
+  // Number of points hashed together by score_batch
+  static constexpr ll SCORE_BLOCK = 64;
+
+  // Per-thread buffers used by score_batch, grown once and then reused across calls
+  struct ScoringScratch {
+    vector<Real> projected;
+    vector<ll> hash_values;
+    vector<pair<Real, ll>> boundaries;
+    vector<ll> probe_values;
+  };
+
+private:
+  ModelBuffer buffer;
+
+  // Projection matrix generated from its seed, for a model saved without it
+  shared_ptr<const ProjectionMatrix<Real>> generated;
+
+  ProjectionView<Real> projections;
+
+  // For each table, maps the hash value of its buckets to their estimator, the values of the view pointing into
+  // the estimators of the table
+  vector<FlatHashMapView<float>> tables;
+
+  ld threshold = 0;
+  ll L = 0, T = 0, DIM = 0;
+
+  // Buckets probed per table next to the bucket of a point (multi-probe LSH), 0 for the bucket alone
+  ll probes = 0;
+
+  // Scoring of dense points compiled for the dimension and L of the model, picked from its header on attach
+  using DenseScoring = void (FrozenLSHADModel::*)(const Real *, size_t, ld *, bool *, ScoringScratch &) const;
+  DenseScoring denseScoring = nullptr;
+
+  FrozenLSHADModel() = default;
+
+  template <typename U>
+  const U *at(uint64_t offset) const {
+    return reinterpret_cast<const U *>(buffer.data() + offset);
+  }
+
+  // Whether count items of the given size starting at offset lie within the model, offset being aligned as every
+  // section is. Written so that the corrupt counts of a damaged file cannot overflow
+  bool holds(uint64_t offset, uint64_t count, uint64_t size) const {
+    uint64_t fileSize = at<ModelHeader>(0)->fileSize;
+    return offset % MODEL_ALIGNMENT == 0 && offset <= fileSize && count <= (fileSize - offset) / size;
+  }
+
+  // Whether the sections of the header lie within the model, so that a truncated or corrupt file is rejected instead
+  // of read out of bounds. The tables are checked by attach as it walks them
+  bool validHeader(const ModelHeader &header) const {
+    if (memcmp(header.magic, MODEL_MAGIC, sizeof(MODEL_MAGIC)) != 0 || header.version != MODEL_VERSION ||
+        header.realSize != sizeof(Real) || header.estimatorSize != sizeof(float) ||
+        header.slotSize != sizeof(FlatSlot) || header.fileSize > buffer.size() ||
+        header.fileSize < sizeof(ModelHeader) || (header.regenerateProjections && header.seed == 0)) {
+      return false;
+    }
+    if (!validFileShape(header.L, header.T, header.dim) || header.probes < 0 || !(header.w > 0) ||
+        !(header.density > 0)) {
+      return false;
+    }
+    uint64_t rows = header.T * header.L;
+    if (!holds(header.tablesOffset, header.T, sizeof(ModelTableEntry)) ||
+        !holds(header.estimatorsOffset, header.estimatorCount, sizeof(float))) {
+      return false;
+    }
+    if (header.regenerateProjections) {
+      return header.projectionsOffset <= header.fileSize &&
+             generatedProjectionFits(header.L, header.T, header.dim, header.density);
+    }
+    if (!holds(header.betasOffset, rows, sizeof(Real))) {
+      return false;
+    }
+    if (!header.sparseProjection) {
+      return holds(header.alphasOffset, rows * header.dim, sizeof(Real));
+    }
+    if (!holds(header.columnOffsetsOffset, header.dim + 1, sizeof(uint64_t)) ||
+        !holds(header.columnRowsOffset, header.projectionNonZeros, sizeof(uint32_t)) ||
+        !holds(header.columnValuesOffset, header.projectionNonZeros, sizeof(Real))) {
+      return false;
+    }
+    // The columns must list the non-zero entries in order, each in a row of the matrix
+    const uint64_t *columnOffsets = at<uint64_t>(header.columnOffsetsOffset);
+    if (columnOffsets[0] != 0 || columnOffsets[header.dim] != header.projectionNonZeros) {
+      return false;
+    }
+    for (ll d = 0; d < header.dim; ++d) {
+      if (columnOffsets[d] > columnOffsets[d + 1]) {
+        return false;
+      }
+    }
+    const uint32_t *columnRows = at<uint32_t>(header.columnRowsOffset);
+    for (uint64_t k = 0; k < header.projectionNonZeros; ++k) {
+      if (columnRows[k] >= rows) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Whether table t of the model lies within it: its slots, a power of two of them each pointing to one of its
+  // entries, its keys and its estimators. Lookups probe until an empty slot or a slot nearer its home, so at least
+  // one slot must be empty and no distance reach the slot count, or a miss could probe forever
+  bool validTable(const ModelHeader &header, const ModelTableEntry &entry) const {
+    if (entry.firstEstimator > header.estimatorCount ||
+        entry.entryCount > header.estimatorCount - entry.firstEstimator ||
+        (entry.slotCount & (entry.slotCount - 1)) != 0 ||
+        (entry.slotCount == 0 ? entry.entryCount > 0 : entry.entryCount >= entry.slotCount) ||
+        !holds(entry.slotsOffset, entry.slotCount, sizeof(FlatSlot)) ||
+        !holds(entry.keysOffset, entry.entryCount * header.L, sizeof(ll))) {
+      return false;
+    }
+    const FlatSlot *slots = at<FlatSlot>(entry.slotsOffset);
+    for (uint64_t s = 0; s < entry.slotCount; ++s) {
+      if (slots[s].entry != FLAT_EMPTY &&
+          (slots[s].entry >= entry.entryCount || slots[s].distance >= entry.slotCount)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Points the model into a buffer holding a serialized model, returns false if it is not a valid model of this type
+  // Every section is checked to lie within the buffer, and every slot to point to an entry of its table
+  bool attach(ModelBuffer model) {
+    buffer = move(model);
+    if (buffer.size() < sizeof(ModelHeader) || !validHeader(*at<ModelHeader>(0))) {
+      return false;
+    }
+    const ModelHeader &header = *at<ModelHeader>(0);
+
+    L = header.L;
+    T = header.T;
+    DIM = header.dim;
+    probes = header.probes;
+    threshold = header.threshold;
+    denseScoring = dispatchShape(DIM, SpecializedDims(), [&](auto Dim) {
+      return dispatchShape(L, SpecializedLs(), [&](auto KeyL) -> DenseScoring {
+        return &FrozenLSHADModel::scoreDense<decltype(Dim)::value, decltype(KeyL)::value>;
+      });
+    });
+    if (header.regenerateProjections) {
+      generated = make_shared<const ProjectionMatrix<Real>>(T, L, DIM, (Real) header.w, header.density, header.seed);
+      projections = generated->view();
+    } else {
+      projections = {at<Real>(header.alphasOffset), at<Real>(header.betasOffset), T * L, DIM, (Real) header.w};
+      if (header.sparseProjection) {
+        projections.columnOffsets = at<uint64_t>(header.columnOffsetsOffset);
+        projections.columnRows = at<uint32_t>(header.columnRowsOffset);
+        projections.columnValues = at<Real>(header.columnValuesOffset);
+      }
+    }
+    const float *estimators = at<float>(header.estimatorsOffset);
+
+    tables.resize(T);
+    for (ll t = 0; t < T; ++t) {
+      const ModelTableEntry &entry = at<ModelTableEntry>(header.tablesOffset)[t];
+      if (!validTable(header, entry)) {
+        return false;
+      }
+      tables[t] = {at<FlatSlot>(entry.slotsOffset), entry.slotCount, at<ll>(entry.keysOffset),
+                   estimators + entry.firstEstimator, (ll) entry.entryCount, L};
+    }
+    return true;
+  }
+
+  // Scores n points hashed SCORE_BLOCK at a time by hashBlock(i0, count), which fills the projections and hash values
+  // of the scratch with those of points i0 to i0 + count
+  // KeyL is L when it is known at compile time, which inlines the lookups of the hash values (see dispatchShape), or 0
+  template <ll KeyL = 0, typename HashBlock>
+  void scoreBlocks(size_t n, HashBlock hashBlock, ld *out_scores, bool *out_flags, ScoringScratch &scratch) const {
+    ll probed = min(probes, 2 * L);
+    if ((ll) scratch.hash_values.size() < SCORE_BLOCK * T * L) {
+      scratch.projected.resize(SCORE_BLOCK * T * L);
+      scratch.hash_values.resize(SCORE_BLOCK * T * L);
+    }
+    if ((ll) scratch.probe_values.size() < 2 * L * L) {
+      scratch.boundaries.reserve(2 * L);
+      scratch.probe_values.resize(2 * L * L);
+    }
+
+    for (size_t i0 = 0; i0 < n; i0 += SCORE_BLOCK) {
+      ll count = min((ll) (n - i0), SCORE_BLOCK);
+      hashBlock(i0, count);
+
+      for (ll i = 0; i < count; ++i) {
+        const ll *hash_value = scratch.hash_values.data() + i * T * L;
+        const Real *projected = scratch.projected.data() + i * T * L;
+
+        // Sum of the estimators of the buckets the point falls in, or probes, in every table
+        ld estimator = 0;
+        for (ll t = 0; t < T; ++t) {
+          ll bucket = tables[t].template find<KeyL>(hash_value + t * L);
+          if (bucket >= 0) {
+            estimator += tables[t].value(bucket);
+          }
+          if (probed > 0) {
+            ll probeCount = projections.probe(projected, hash_value, t, L, probed, scratch.boundaries,
+                                              scratch.probe_values.data());
+            for (ll p = 0; p < probeCount; ++p) {
+              bucket = tables[t].template find<KeyL>(scratch.probe_values.data() + p * L);
+              if (bucket >= 0) {
+                estimator += tables[t].value(bucket);
+              }
+            }
+          }
+        }
+
+        if (out_scores != nullptr) {
+          out_scores[i0 + i] = estimator;
+        }
+        if (out_flags != nullptr) {
+          out_flags[i0 + i] = estimator <= threshold;
+        }
+      }
+    }
+  }
+
+  template <ll Dim, ll KeyL>
+  void scoreDense(const Real *rows, size_t n, ld *out_scores, bool *out_flags, ScoringScratch &scratch) const {
+    scoreBlocks<KeyL>(n, [&](size_t i0, ll count) {
+      // Hashes the whole block with one pass over the projection matrix
+      projections.template hash<Dim>(rows + i0 * DIM, count, scratch.projected.data(), scratch.hash_values.data());
+    }, out_scores, out_flags, scratch);
+  }
+
+public:
+  // Model of trained tables and their estimators, probing probes buckets per table around the bucket of a point
+  // The slots and keys of the tables are copied as they are, so the ID of a bucket in the model is its ID in the
+  // tables and its estimator is found at the first estimator of its table plus that ID
+  FrozenLSHADModel(const HashTables<Real> &hasher, const BucketEstimators &estimators, ld threshold, ll probes = 0) {
+    ll L = hasher.getL(), T = hasher.getT(), DIM = hasher.getDim();
+    const ProjectionMatrix<Real> &matrix = hasher.getProjections();
+    ProjectionView<Real> view = matrix.view();
+
+    // Lays out the sections of the model
+    ModelHeader header{};
+    memcpy(header.magic, MODEL_MAGIC, sizeof(MODEL_MAGIC));
+    header.version = MODEL_VERSION;
+    header.realSize = sizeof(Real);
+    header.estimatorSize = sizeof(float);
+    header.slotSize = sizeof(FlatSlot);
+    header.L = L;
+    header.T = T;
+    header.dim = DIM;
+    header.probes = probes;
+    header.w = matrix.width();
+    header.threshold = threshold;
+    header.seed = matrix.getSeed();
+    header.density = matrix.getDensity();
+
+    uint64_t offset = alignModelOffset(sizeof(ModelHeader));
+    header.tablesOffset = offset;
+    offset = alignModelOffset(offset + T * sizeof(ModelTableEntry));
+    vector<ModelTableEntry> entries(T);
+    for (ll t = 0; t < T; ++t) {
+      assert((ll) estimators[t].size() == hasher.getTables()[t].size());
+      entries[t].firstEstimator = header.estimatorCount;
+      header.estimatorCount += estimators[t].size();
+    }
+    header.estimatorsOffset = offset;
+    offset = alignModelOffset(offset + header.estimatorCount * sizeof(float));
+
+    for (ll t = 0; t < T; ++t) {
+      auto table = hasher.getTables()[t].view();
+      entries[t].slotCount = table.slotCount;
+      entries[t].entryCount = table.size;
+      entries[t].slotsOffset = offset;
+      offset = alignModelOffset(offset + table.slotCount * sizeof(FlatSlot));
+      entries[t].keysOffset = offset;
+      offset = alignModelOffset(offset + table.size * L * sizeof(ll));
+    }
+    header.projectionsOffset = offset;
+    header.betasOffset = offset;
+    offset = alignModelOffset(offset + T * L * sizeof(Real));
+    header.alphasOffset = offset;
+    offset = alignModelOffset(offset + (view.sparse() ? 0 : T * L * DIM) * sizeof(Real));
+    if (view.sparse()) {
+      header.sparseProjection = 1;
+      header.projectionNonZeros = view.columnOffsets[DIM];
+      header.columnOffsetsOffset = offset;
+      offset = alignModelOffset(offset + (DIM + 1) * sizeof(uint64_t));
+      header.columnRowsOffset = offset;
+      offset = alignModelOffset(offset + header.projectionNonZeros * sizeof(uint32_t));
+      header.columnValuesOffset = offset;
+      offset = alignModelOffset(offset + header.projectionNonZeros * sizeof(Real));
+    }
+    header.fileSize = offset;
+
+    // Writes the sections
+    ModelBuffer model(header.fileSize);
+    char *out = model.data();
+    memcpy(out, &header, sizeof(header));
+    memcpy(out + header.tablesOffset, entries.data(), T * sizeof(ModelTableEntry));
+    memcpy(out + header.betasOffset, view.betas, T * L * sizeof(Real));
+    if (view.sparse()) {
+      memcpy(out + header.columnOffsetsOffset, view.columnOffsets, (DIM + 1) * sizeof(uint64_t));
+      memcpy(out + header.columnRowsOffset, view.columnRows, header.projectionNonZeros * sizeof(uint32_t));
+      memcpy(out + header.columnValuesOffset, view.columnValues, header.projectionNonZeros * sizeof(Real));
+    } else {
+      memcpy(out + header.alphasOffset, view.alphas, T * L * DIM * sizeof(Real));
+    }
+    for (ll t = 0; t < T; ++t) {
+      auto table = hasher.getTables()[t].view();
+      memcpy(out + header.estimatorsOffset + entries[t].firstEstimator * sizeof(float), estimators[t].data(),
+             estimators[t].size() * sizeof(float));
+      memcpy(out + entries[t].slotsOffset, table.slots, table.slotCount * sizeof(FlatSlot));
+      memcpy(out + entries[t].keysOffset, table.keys, table.size * L * sizeof(ll));
+    }
+
+    attach(move(model));
+  }
+
+  // Sets the threshold of a model built in memory, in its header too, before the model is shared with scoring threads
+  void setThreshold(ld threshold) {
+    reinterpret_cast<ModelHeader *>(buffer.data())->threshold = threshold;
+    this->threshold = threshold;
+  }
+
+  // Maps a model file saved by save and scores from it in place, returns null if it is not a valid model of this type
+  static shared_ptr<const FrozenLSHADModel> load(const string &path) {
+    ModelBuffer model = ModelBuffer::map(path);
+    if (model.empty()) {
+      return nullptr;
+    }
+    shared_ptr<FrozenLSHADModel> frozen(new FrozenLSHADModel());
+    if (!frozen->attach(move(model))) {
+      return nullptr;
+    }
+    return frozen;
+  }
+
+  // Writes the model in the binary model format, returns false if the file cannot be written
+  // Without the projections, a model of a seeded matrix is written without its projection matrix, which is generated
+  // again from the seed when loading: a much smaller file, at the cost of the generation time when loading
+  bool save(const string &path, bool withProjections = true) const {
+    ModelHeader header = *at<ModelHeader>(0);
+    if (!withProjections && header.seed != 0) {
+      header.regenerateProjections = 1;
+      header.fileSize = header.projectionsOffset;
+    }
+    ofstream file(path, ios::binary | ios::trunc);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(buffer.data() + sizeof(header), header.fileSize - sizeof(header));
+    return (bool) file;
+  }
+
+  // Size of the model in bytes
+  size_t bytes() const {
+    return at<ModelHeader>(0)->fileSize;
+  }
+
+  ll getL() const {
+    return L;
+  }
+
+  ll getT() const {
+    return T;
+  }
+
+  ll getDim() const {
+    return DIM;
+  }
+
+  ld getThreshold() const {
+    return threshold;
+  }
+
+  ll getProbes() const {
+    return probes;
+  }
+
+  // Scores n row-major points of dimension dim, writing the summed estimator of each point to out_scores
+  // and whether it is an anomaly to out_flags (either may be null)
+  // Returns false, scoring nothing, if dim is not the dimension of the model
+  bool score_batch(const Real *rows, size_t n, size_t dim, ld *out_scores, bool *out_flags, ScoringScratch &scratch) const {
+    if ((ll) dim != DIM) {
+      return false;
+    }
+    (this->*denseScoring)(rows, n, out_scores, out_flags, scratch);
+    return true;
+  }
+
+  // Same as above for n sparse points of rows from point first, false if they are not all in rows
+  bool score_batch(const SparseRows<Real> &rows, ll first, ll n, ld *out_scores, bool *out_flags,
+                   ScoringScratch &scratch) const {
+    if (rows.dim() != DIM || first < 0 || n < 0 || first + n > rows.size()) {
+      return false;
+    }
+    scoreBlocks(n, [&](size_t i0, ll count) {
+      projections.hash(rows, first + i0, count, scratch.projected.data(), scratch.hash_values.data());
+    }, out_scores, out_flags, scratch);
+    return true;
+  }
+
+  // Same as above, with scratch buffers owned by the calling thread
+  bool score_batch(const Real *rows, size_t n, size_t dim, ld *out_scores, bool *out_flags) const {
+    thread_local ScoringScratch scratch;
+    return score_batch(rows, n, dim, out_scores, out_flags, scratch);
+  }
+
+  bool score_batch(const SparseRows<Real> &rows, ll first, ll n, ld *out_scores, bool *out_flags) const {
+    thread_local ScoringScratch scratch;
+    return score_batch(rows, first, n, out_scores, out_flags, scratch);
+  }
+};
@@ -8,159 +8,792 @@ typedef long double ld;
 #include <vector>
 #include <random>
 #include <cmath>
+#include <cassert>
 #include "hashes.h"
+#include "PointStore.h"
+#include "SparseRows.h"
+#include "Random.h"
+#include "FlatHashMap.h"
+#include "BucketArena.h"
+#include "Kernels.h"
+#include "Parallel.h"
+#include "Stats.h"
 #include <unordered_map>
 #include <algorithm>
 
 using namespace std;
 
-inline ld dot_product(const vector<ld> &v1, const vector<ld> &v2) {
-  ld result = 0;
-
-  for (ll i = 0; i < (ll) v1.size(); ++i) {
-    result += v1[i] * v2[i];
-  }
-
-  return result;
-}
-
+template <typename Real = ld>
 class RandomProjection {
 private:
   // Generates Alpha, a random vector drawn from a Gaussian distribution
-  static vector<ld> generate_alpha(const ll &n_dims, const ld &mean = 0.0, const ld &stddev = 1.0) {
-    random_device rd;
-    default_random_engine generator(rd());
-    normal_distribution<ld> distribution(mean, stddev);
-
-    vector<ld> alpha(n_dims);
+  static vector<Real> generate_alpha(const ll &n_dims, CounterRng &generator, const Real &mean = 0.0, const Real &stddev = 1.0) {
+    vector<Real> alpha(n_dims);
     for (ll i = 0; i < n_dims; ++i) {
-      alpha[i] = distribution(generator);
+      alpha[i] = mean + stddev * (Real) generator.gaussian();
     }
 
     return alpha;
   }
 
   // Generates Beta, a real number uniformly chosen from the interval [0:w]
-  static ld generate_beta(const ld &w) {
-    random_device rd;
-    default_random_engine generator(rd());
-    uniform_real_distribution<ld> distribution(0.0, w);
-
-    ld beta = distribution(generator);
-
-    return beta;
+  static Real generate_beta(const Real &w, CounterRng &generator) {
+    return (Real) generator.uniform() * w;
   }
 
 public:
   // Calculates the values of the random projection that will map a d dimensional vector x onto the set of integers
-  static pair<vector<ld>, ld> calculate_projection(const ll &dim, const ld &w) {
-    vector<ld> alpha = generate_alpha(dim);
-    ld beta = generate_beta(w);
+  static pair<vector<Real>, Real> calculate_projection(const ll &dim, const Real &w, CounterRng &generator) {
+    vector<Real> alpha = generate_alpha(dim, generator);
+    Real beta = generate_beta(w, generator);
     
     return make_pair(alpha, beta);
   }
 };
 
+template <typename Real = ld>
 class HashFunction {
 public:
   // Generates a hash function, represented by L random projections, defining the hash value
-  static vector<pair<vector<ld>, ld>> generate_hash_function(const ll &dim, const ld &w, const ll &L) {
-    vector<pair<vector<ld>, ld>> hash_function(L);
+  // Projection l is drawn from stream first + l of the seed, so the projections of every table can be regenerated
+  static vector<pair<vector<Real>, Real>> generate_hash_function(const ll &dim, const Real &w, const ll &L,
+                                                                 uint64_t seed, ll first = 0) {
+    vector<pair<vector<Real>, Real>> hash_function(L);
 
     for (ll i = 0; i < L; ++i) {
-      hash_function[i] = RandomProjection::calculate_projection(dim, w);
+      CounterRng generator(seed, first + i);
+      hash_function[i] = RandomProjection<Real>::calculate_projection(dim, w, generator);
     }
 
     return hash_function;
   }
 };
 
+// Read-only view of a projection matrix, which may live in a ProjectionMatrix or in a mapped model file
+// Row t * L + l holds the alpha vector of projection l of table t
+// A sparse matrix has no alphas, its non-zero entries are listed by column instead: the entries of column d are
+// columnValues[k] in row columnRows[k], for k from columnOffsets[d] to columnOffsets[d + 1]
+template <typename Real = ld>
+struct ProjectionView {
+  // Number of points and projections processed together, so a block of projections stays in cache
+  static constexpr ll POINT_BLOCK = 64;
+  static constexpr ll PROJECTION_BLOCK = 32;
+
+  const Real *alphas;
+  const Real *betas;
+  ll rows;
+  ll DIM;
+  Real w;
+
+  const uint64_t *columnOffsets = nullptr;
+  const uint32_t *columnRows = nullptr;
+  const Real *columnValues = nullptr;
+
+  bool sparse() const {
+    return columnOffsets != nullptr;
+  }
+
+  // Alpha vector of a row of a dense matrix
+  const Real *alpha(ll row) const {
+    return alphas + row * DIM;
+  }
+
+  // Computes dot(x, alpha) of the n row-major points in x against every projection (n x DIM by DIM x rows)
+  // Dim is DIM when it is known at compile time, which unrolls the dot products (see dispatchShape), or 0
+  template <ll Dim = 0>
+  void project(const Real *x, ll n, Real *projected) const {
+    if (sparse()) {
+      for (ll i = 0; i < n; ++i) {
+        Real *out = projected + i * rows;
+        fill(out, out + rows, 0);
+        for (ll d = 0; d < DIM; ++d) {
+          addColumn(d, x[i * DIM + d], out);
+        }
+      }
+      return;
+    }
+    for (ll i0 = 0; i0 < n; i0 += POINT_BLOCK) {
+      ll i1 = min(n, i0 + POINT_BLOCK);
+      for (ll r0 = 0; r0 < rows; r0 += PROJECTION_BLOCK) {
+        ll r1 = min(rows, r0 + PROJECTION_BLOCK);
+        for (ll i = i0; i < i1; ++i) {
+          const Real *point = x + i * DIM;
+          Real *out = projected + i * rows;
+          for (ll r = r0; r < r1; ++r) {
+            if constexpr (Dim > 0) {
+              out[r] = dot_product_fixed<Dim>(point, alphas + r * Dim);
+            } else {
+              out[r] = dot_product(point, alpha(r), DIM);
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // Adds value times column d of the matrix to the rows projections in out
+  void addColumn(ll d, Real value, Real *out) const {
+    if (value == 0) {
+      return;
+    }
+    if (sparse()) {
+      for (uint64_t k = columnOffsets[d]; k < columnOffsets[d + 1]; ++k) {
+        out[columnRows[k]] += value * columnValues[k];
+      }
+    } else {
+      for (ll r = 0; r < rows; ++r) {
+        out[r] += value * alphas[r * DIM + d];
+      }
+    }
+  }
+
+  // Computes dot(x, alpha) of the n sparse points of x from point first, in O(nnz * rows) for a dense matrix
+  // and O(nnz * rows * density) for a sparse one
+  void project(const SparseRows<Real> &x, ll first, ll n, Real *projected) const {
+    for (ll i = 0; i < n; ++i) {
+      Real *out = projected + i * rows;
+      fill(out, out + rows, 0);
+      SparseRow<Real> point = x.row(first + i);
+      for (ll k = 0; k < point.nnz; ++k) {
+        addColumn(point.indices[k], point.values[k], out);
+      }
+    }
+  }
+
+  // Quantizes the projections of n points into hash values: floor((dot(x, alpha) + beta) / w)
+  void quantize(const Real *projected, ll n, ll *hash_values) const {
+    for (ll i = 0; i < n; ++i) {
+      ::quantize(projected + i * rows, betas, rows, w, hash_values + i * rows);
+    }
+  }
+
+  // Hashes n points, writing the T * L hash values of each point; projected is scratch of n * rows values
+  template <ll Dim = 0>
+  void hash(const Real *x, ll n, Real *projected, ll *hash_values) const {
+    project<Dim>(x, n, projected);
+    quantize(projected, n, hash_values);
+  }
+
+  void hash(const SparseRows<Real> &x, ll first, ll n, Real *projected, ll *hash_values) const {
+    project(x, first, n, projected);
+    quantize(projected, n, hash_values);
+  }
+
+  // Multi-probe LSH (Lv et al.): writes to probe_values the L hash values of each of the probes buckets of table t
+  // around the bucket of a point, nearest first. Each probe moves one of the L values one step toward the bin
+  // boundary the point is closest to; projected and hash_values are the rows of the point computed by hash
+  // Returns the number of probes written, at most 2 * L
+  ll probe(const Real *projected, const ll *hash_values, ll t, ll L, ll probes, vector<pair<Real, ll>> &boundaries,
+           ll *probe_values) const {
+    boundaries.clear();
+    for (ll l = 0; l < L; ++l) {
+      ll r = t * L + l;
+      Real offset = (projected[r] + betas[r]) / w - (Real) hash_values[r];
+      // Distance to the lower boundary, probed by the step -1, and to the upper one, probed by the step +1
+      boundaries.emplace_back(offset, 2 * l);
+      boundaries.emplace_back(1 - offset, 2 * l + 1);
+    }
+    ll count = min(probes, 2 * L);
+    partial_sort(boundaries.begin(), boundaries.begin() + count, boundaries.end());
+
+    for (ll p = 0; p < count; ++p) {
+      ll *out = probe_values + p * L;
+      copy(hash_values + t * L, hash_values + (t + 1) * L, out);
+      ll l = boundaries[p].second / 2;
+      out[l] += boundaries[p].second % 2 == 0 ? -1 : 1;
+    }
+    return count;
+  }
+};
+
+// The T * L random projections of a HashTables packed into one contiguous matrix
+// Row t * L + l holds the alpha vector of projection l of table t
+// With a density below 1 the matrix is a very sparse random projection (Achlioptas; Li, Hastie and Church): each
+// entry is +-sqrt(1 / density) with probability density / 2 each and 0 otherwise, and only the non-zero entries are
+// stored, by column. Entries have unit variance as the Gaussian ones, so the same w fits both
+// The matrix is a function of its shape, w, density and seed: the same seed always gives the same matrix, and a
+// seed of 0 draws one from the system
+template <typename Real = ld>
+class ProjectionMatrix {
+private:
+  vector<Real> alphas;
+  vector<Real> betas;
+  ll rows;
+  ll DIM;
+  Real w;
+  ld density = 1;
+  // 0 for a matrix that cannot be regenerated, e.g. converted from another numeric type
+  uint64_t seed = 0;
+
+  // Non-zero entries by column of a sparse matrix, see ProjectionView
+  bool sparse = false;
+  vector<uint64_t> columnOffsets;
+  vector<uint32_t> columnRows;
+  vector<Real> columnValues;
+
+public:
+  ProjectionMatrix(ll T, ll L, ll dim, Real w, ld density = 1, uint64_t seed = 0)
+      : rows(T * L), DIM(dim), w(w), density(min(density, (ld) 1)), seed(resolveSeed(seed)) {
+    if (density < 1) {
+      generateSparse();
+      return;
+    }
+    alphas.reserve(rows * DIM);
+    betas.reserve(rows);
+    for (ll t = 0; t < T; ++t) {
+      for (const auto &projection : HashFunction<Real>::generate_hash_function(DIM, w, L, this->seed, t * L)) {
+        alphas.insert(alphas.end(), projection.first.begin(), projection.first.end());
+        betas.push_back(projection.second);
+      }
+    }
+  }
+
+  // Converts a projection matrix of another numeric type, so that models of different precision share projections
+  template <typename Other>
+  explicit ProjectionMatrix(const ProjectionMatrix<Other> &other)
+      : betas(other.size()), rows(other.size()), DIM(other.dim()), w((Real) other.width()), density(other.getDensity()) {
+    ProjectionView<Other> view = other.view();
+    for (ll r = 0; r < rows; ++r) {
+      betas[r] = (Real) other.beta(r);
+    }
+    if (view.sparse()) {
+      sparse = true;
+      columnOffsets.assign(view.columnOffsets, view.columnOffsets + DIM + 1);
+      columnRows.assign(view.columnRows, view.columnRows + columnOffsets[DIM]);
+      columnValues.assign(view.columnValues, view.columnValues + columnOffsets[DIM]);
+      return;
+    }
+    alphas.resize(rows * DIM);
+    for (ll r = 0; r < rows; ++r) {
+      for (ll d = 0; d < DIM; ++d) {
+        alphas[r * DIM + d] = (Real) other.alpha(r)[d];
+      }
+    }
+  }
+
+private:
+  // Stream r of the seed draws the beta of row r, and stream rows the non-zero entries
+  void generateSparse() {
+    Real scale = (Real) sqrtl(1 / density);
+
+    sparse = true;
+    for (ll r = 0; r < rows; ++r) {
+      CounterRng generator(seed, r);
+      betas.push_back((Real) generator.uniform() * w);
+    }
+    // Walks the matrix column by column, jumping over the zero entries between two non-zero ones
+    CounterRng generator(seed, rows);
+    columnOffsets.assign(DIM + 1, 0);
+    for (ll k = generator.geometric(density); k < rows * DIM; k += generator.geometric(density) + 1) {
+      ll d = k / rows;
+      columnOffsets[d + 1]++;
+      columnRows.push_back((uint32_t) (k % rows));
+      columnValues.push_back(generator.uniform() < 0.5 ? scale : -scale);
+    }
+    for (ll d = 0; d < DIM; ++d) {
+      columnOffsets[d + 1] += columnOffsets[d];
+    }
+  }
+
+public:
+  ll size() const {
+    return rows;
+  }
+
+  ll dim() const {
+    return DIM;
+  }
+
+  Real width() const {
+    return w;
+  }
+
+  ld getDensity() const {
+    return density;
+  }
+
+  uint64_t getSeed() const {
+    return seed;
+  }
+
+  // Alpha vector of a row of a dense matrix
+  const Real *alpha(ll row) const {
+    return alphas.data() + row * DIM;
+  }
+
+  Real beta(ll row) const {
+    return betas[row];
+  }
+
+  ProjectionView<Real> view() const {
+    if (sparse) {
+      return {alphas.data(), betas.data(), rows, DIM, w, columnOffsets.data(), columnRows.data(), columnValues.data()};
+    }
+    return {alphas.data(), betas.data(), rows, DIM, w};
+  }
+
+  void project(const Real *x, ll n, Real *projected) const {
+    view().project(x, n, projected);
+  }
+
+  void quantize(const Real *projected, ll n, ll *hash_values) const {
+    view().quantize(projected, n, hash_values);
+  }
+
+  // Hashes n points, writing the T * L hash values of each point; projected is scratch of n * rows values
+  void hash(const Real *x, ll n, Real *projected, ll *hash_values) const {
+    view().hash(x, n, projected, hash_values);
+  }
+};
+
+// A hash table maps every hash value to its bucket, the IDs of the points that landed in it
+// Bucket IDs are the dense entry IDs of the map, and the point IDs of all the buckets live in the arena of the table
+class HashTable : public FlatHashMap<Bucket> {
+private:
+  BucketArena arena;
+
+public:
+  explicit HashTable(ll L = 0) : FlatHashMap<Bucket>(L) {}
+
+  ll bucketSize(uint32_t bucket) const {
+    return value(bucket).size;
+  }
+
+  void add(uint32_t bucket, uint32_t id) {
+    arena.add(value(bucket), id);
+  }
+
+  // Removes a point from a bucket, which is left in the table even if empty
+  void remove(uint32_t bucket, uint32_t id) {
+    arena.remove(value(bucket), id);
+  }
+
+  // Calls fn(id) for every point of a bucket
+  template <typename Fn>
+  void forEachPoint(uint32_t bucket, Fn fn) const {
+    arena.forEach(value(bucket), fn);
+  }
+
+  size_t bytes() const {
+    return FlatHashMap<Bucket>::bytes() + arena.bytes();
+  }
+};
+
+// Estimator of every bucket of every table: estimators[t][bucket] for the bucket of ID bucket of table t
+// Each table has its own estimators, so buckets of different tables with the same hash value do not share one
+using BucketEstimators = vector<vector<float>>;
+
+template <typename Real = ld>
 class HashTables {
 private:
   // Vector of T hash tables
-  // Each hash table uses an unordered map to map a hash value to a vector of data points
-  vector<unordered_map<InnerHash, vector<vector<ld>>, InnerMapHash, InnerMapEqual>> tables;
+  vector<HashTable> tables;
+
+  // L random projections for each hash table, packed into a single matrix
+  ProjectionMatrix<Real> projections;
+
+  // Scratch buffers for hashing blocks of points
+  vector<Real> projected;
+  vector<ll> hash_values;
+
+  // Inserted points, stored once and indexed by the ID assigned to them on insertion
+  // Points are either all dense, in points, or all sparse, in sparsePoints
+  PointStore<Real> points;
+  SparseRows<Real> sparsePoints;
+
+  // For each point, the ID of the bucket it landed in on each of the T tables (row-major, T per point)
+  vector<uint32_t> buckets_per_points;
 
-  // Vector of L random projections for each hash table
-  vector<vector<pair<vector<ld>, ld>>> random_projections;
+  // Epoch-stamped visited array used by countNeighbors to union buckets without a set
+  struct NeighborScratch {
+    vector<ll> visited;
+    ll epoch = 0;
+  };
+  NeighborScratch scratch;
 
-  vector<vector<vector<ll>>> hashes_per_points;
+  // Number of neighbors of each point, as of the last estimatePerHash or updateEstimators
+  vector<ll> neighborCounts;
+
+  // In a window (see insertWindowed), ID of the oldest point, which the next point replaces
+  uint32_t oldest = 0;
+
+  // Scratch of updateEstimators and insertWindowed, kept so that updates reuse it instead of allocating
+  // touchedKeys holds records of a table followed by the L hash values of one of its buckets (see touch)
+  vector<pair<ll, uint32_t>> touchedBuckets;
+  vector<ll> touchedKeys;
+  vector<uint32_t> touchedOrder;
+
+  // Number of threads used for batch insertion and estimation, 0 meaning one per hardware thread
+  ll threads = 1;
 
   // L: Number of random projections for each hash function
   // T: Number of hash tables
   // Size of the quantization bins used for the random projections
   ll L, T;
-  ld w;
+  Real w;
   ll DIM;
 
+  // Hashing of dense points compiled for the dimension of the tables, picked from it on construction
+  using DenseHash = void (ProjectionView<Real>::*)(const Real *, ll, Real *, ll *) const;
+  DenseHash denseHash = pickDenseHash(DIM);
+
+  static DenseHash pickDenseHash(ll dim) {
+    return dispatchShape(dim, SpecializedDims(), [](auto Dim) -> DenseHash {
+      return &ProjectionView<Real>::template hash<decltype(Dim)::value>;
+    });
+  }
+
+  void hashDense(const Real *x, ll n, Real *projected, ll *hash_values) const {
+    (projections.view().*denseHash)(x, n, projected, hash_values);
+  }
+
 public:
-  HashTables(ll L, ll T, ld w, ll dim) : L(L), T(T), w(w), DIM(dim) {
-    tables.resize(T);
-    random_projections.resize(T);
-    for(int i = 0; i < T; ++i){
-      random_projections[i].resize(L);
-      // Generates L random projections for each hass table
-      random_projections[i] = HashFunction::generate_hash_function(DIM, w, L);
-    }
+  // Number of points hashed together when inserting a batch
+  static constexpr ll HASH_BATCH = 256;
+
+  // Number of points copied into the store and inserted in the tables at a time by insertBatch
+  static constexpr ll INSERT_CHUNK = 8192;
+
+  // With a density below 1 the projections are very sparse; a seed other than 0 makes them reproducible
+  // (see ProjectionMatrix)
+  HashTables(ll L, ll T, Real w, ll dim, ld density = 1, uint64_t seed = 0)
+      : projections(T, L, dim, w, density, seed), points(dim), sparsePoints(dim), L(L), T(T), w(w), DIM(dim) {
+    tables.assign(T, HashTable(L));
+  }
+
+  // Builds the tables over existing projections, e.g. converted from a model of another numeric type
+  HashTables(ll L, ll T, ProjectionMatrix<Real> projections)
+      : projections(move(projections)), points(this->projections.dim()), sparsePoints(this->projections.dim()), L(L), T(T),
+        w(this->projections.width()), DIM(this->projections.dim()) {
+    tables.assign(T, HashTable(L));
+  }
+
+  void setThreads(ll threads) {
+    this->threads = threads;
+  }
+
+  ll getThreads() const {
+    return threads;
+  }
+
+  ll getL() const {
+    return L;
+  }
+
+  ll getT() const {
+    return T;
+  }
+
+  ll getDim() const {
+    return DIM;
+  }
+
+  const ProjectionMatrix<Real> &getProjections() const {
+    return projections;
   }
 
-  const vector<unordered_map<InnerHash, vector<vector<ld>>, InnerMapHash, InnerMapEqual>> &getTables() const {
+  const vector<HashTable> &getTables() const {
     return tables;
   }
 
-  const vector<vector<vector<ll>>> &getHashesPerPoints() const {
-    return hashes_per_points;
+  // IDs of the T buckets the point with the given ID landed in
+  const uint32_t *getBucketsOfPoint(uint32_t id) const {
+    return buckets_per_points.data() + (size_t) id * T;
+  }
+
+  const PointStore<Real> &getPoints() const {
+    return points;
+  }
+
+  const SparseRows<Real> &getSparsePoints() const {
+    return sparsePoints;
+  }
+
+  // Whether the points were inserted as sparse rows
+  bool isSparse() const {
+    return sparsePoints.size() > 0;
+  }
+
+  ll size() const {
+    return points.size() + sparsePoints.size();
   }
 
   void print() {
     int idx = 0;
-    for(auto table : tables) {
+    for(const auto &table : tables) {
       cout << "\n------- Table: " << idx++ << "-------" << endl;
-      for(auto bucket : table) {
+      for(uint32_t bucket = 0; bucket < (uint32_t) table.size(); ++bucket) {
         cout << "Bucket: ";
-        for (auto hash : bucket.first) {
-          cout << hash << " ";
+        for (ll l = 0; l < L; ++l) {
+          cout << table.key(bucket)[l] << " ";
         }
         cout << ": " << endl;
-        for(auto point : bucket.second) {
+        table.forEachPoint(bucket, [&](uint32_t id) {
           cout << "[";
-          for(auto coord : point) {
-            cout << coord << " ";
+          for(ll d = 0; d < DIM; ++d) {
+            cout << points[id][d] << " ";
           }
           cout << "]" << endl;
-        }
+        });
         cout << endl;
       }
     }
   }
 
-  vector<ll> hash(const vector<ld> &x, const ll t){
-    vector<ll> hash_values(L);
+  // Writes the L hash values of x for table t into hash_values
+  void hash(const Real *x, const ll t, ll *hash_values){
     for (ll l = 0; l < L; ++l) {
-      ld numerator = dot_product(x, random_projections[t][l].first) + random_projections[t][l].second;
+      Real numerator = dot_product(x, projections.alpha(t * L + l), DIM) + projections.beta(t * L + l);
       hash_values[l] = floor(numerator / w);
     }
+  }
+
+  // Writes the T * L hash values of each of the n row-major points in x into out
+  void hashBatch(const Real *x, ll n, ll *out) {
+    if ((ll) projected.size() < n * T * L) {
+      projected.resize(n * T * L);
+    }
+    hashDense(x, n, projected.data(), out);
+  }
+
+  vector<ll> hash(const vector<Real> &x, const ll t){
+    vector<ll> hash_values(L);
+    hash(x.data(), t, hash_values.data());
 
     return hash_values;
   }
 
-  void insert(const vector<ld> &x) {
-    // For each of the T hash tables...
-    vector<vector<ll>> hashes_per_point;
-    for (ll t = 0; t < T; ++t) {
-      // Generates the hash value based on the L random projections of the table
-      vector<ll> hash_value = hash(x, t);
-      hashes_per_point.push_back(hash_value);
+  // Inserts a data point and returns the ID assigned to it
+  uint32_t insert(const vector<Real> &x) {
+    uint32_t id = points.add(x);
+    insertStored(id, 1);
+
+    return id;
+  }
 
-      // And inserts the data point in the corresponding bucket
-      auto bucket = tables[t].find(hash_value);
-      if (bucket == tables[t].end()) {
-        tables[t][hash_value] = {x};
+  // Inserts n row-major points, hashing them in blocks of HASH_BATCH points
+  void insertBatch(const Real *x, ll n) {
+    reserve(n);
+    for (ll i0 = 0; i0 < n; i0 += INSERT_CHUNK) {
+      ll count = min(INSERT_CHUNK, n - i0);
+      uint32_t first = (uint32_t) points.size();
+      for (ll i = i0; i < i0 + count; ++i) {
+        points.add(x + i * DIM);
+      }
+      insertStored(first, count);
+    }
+  }
+
+  // Inserts n sparse points of x from point first, without ever densifying them
+  void insertBatch(const SparseRows<Real> &x, ll first, ll n) {
+    assert(x.dim() == DIM);
+    buckets_per_points.reserve((size() + n) * T);
+    for (ll i0 = 0; i0 < n; i0 += INSERT_CHUNK) {
+      ll count = min(INSERT_CHUNK, n - i0);
+      uint32_t id = (uint32_t) size();
+      sparsePoints.append(x, first + i0, count);
+      insertStored(id, count);
+    }
+  }
+
+  void insertBatch(const SparseRows<Real> &x) {
+    insertBatch(x, 0, x.size());
+  }
+
+  // Writes the T * L hash values of n sparse points of x from point first into out
+  void hashBatch(const SparseRows<Real> &x, ll first, ll n, ll *out) {
+    if ((ll) projected.size() < n * T * L) {
+      projected.resize(n * T * L);
+    }
+    projections.view().hash(x, first, n, projected.data(), out);
+  }
+
+  void insertBatch(const vector<vector<Real>> &data) {
+    reserve((ll) data.size());
+    for (ll i0 = 0; i0 < (ll) data.size(); i0 += INSERT_CHUNK) {
+      ll count = min(INSERT_CHUNK, (ll) data.size() - i0);
+      uint32_t first = (uint32_t) points.size();
+      for (ll i = i0; i < i0 + count; ++i) {
+        points.add(data[i]);
+      }
+      insertStored(first, count);
+    }
+  }
+
+private:
+  // Reserves room for n more points
+  void reserve(ll n) {
+    points.reserve(points.size() + n);
+    buckets_per_points.reserve((size() + n) * T);
+  }
+
+  // Hashes the count points already in the store starting at ID first, and inserts them in the tables
+  // Blocks of points are hashed concurrently, then each worker inserts the whole range into its own tables
+  // in ID order, so the tables are the same for any number of threads
+  void insertStored(uint32_t first, ll count) {
+    if ((ll) hash_values.size() < count * T * L) {
+      hash_values.resize(count * T * L);
+    }
+    if ((ll) projected.size() < count * T * L) {
+      projected.resize(count * T * L);
+    }
+    buckets_per_points.resize((first + count) * T);
+
+    parallelFor(count, threads, HASH_BATCH, [&](ll begin, ll end, ll) {
+      if (isSparse()) {
+        projections.view().hash(sparsePoints, first + begin, end - begin,
+                                projected.data() + begin * T * L, hash_values.data() + begin * T * L);
       } else {
-        bucket->second.push_back(x);
+        hashDense(points[first + (uint32_t) begin], end - begin, projected.data() + begin * T * L,
+                  hash_values.data() + begin * T * L);
+      }
+    });
+
+    parallelFor(T, threads, 1, [&](ll t0, ll t1, ll) {
+      for (ll t = t0; t < t1; ++t) {
+        for (ll i = 0; i < count; ++i) {
+          uint32_t id = first + (uint32_t) i;
+          uint32_t bucket = tables[t].insert(hash_values.data() + i * T * L + t * L);
+          tables[t].add(bucket, id);
+          buckets_per_points[(size_t) id * T + t] = bucket;
+        }
+      }
+    });
+  }
+
+  // Calls fn(neighbor) once for every distinct point sharing at least one bucket with the point of the given ID
+  template <typename Fn>
+  void forEachNeighbor(uint32_t id, NeighborScratch &scratch, Fn fn) const {
+    if ((ll) scratch.visited.size() < size()) {
+      scratch.visited.resize(size(), 0);
+    }
+    ll epoch = ++scratch.epoch;
+    vector<ll> &visited = scratch.visited;
+
+    visited[id] = epoch;
+    const uint32_t *buckets = getBucketsOfPoint(id);
+    for (ll t = 0; t < T; ++t) {
+      tables[t].forEachPoint(buckets[t], [&](uint32_t neighbor) {
+        if (visited[neighbor] != epoch) {
+          visited[neighbor] = epoch;
+          fn(neighbor);
+        }
+      });
+    }
+  }
+
+  ll countNeighbors(uint32_t id, NeighborScratch &scratch) const {
+    ll count = 0;
+    forEachNeighbor(id, scratch, [&](uint32_t) { ++count; });
+
+    return count;
+  }
+
+  // Records bucket of table t in touchedKeys as t followed by its hash value, as bucket IDs change when one is erased
+  void touch(ll t, uint32_t bucket) {
+    touchedKeys.push_back(t);
+    touchedKeys.insert(touchedKeys.end(), tables[t].key(bucket), tables[t].key(bucket) + L);
+  }
+
+  // Removes the point of the given ID from its buckets, erasing the buckets left empty along with their estimators
+  void detach(uint32_t id, BucketEstimators &estimators) {
+    forEachNeighbor(id, scratch, [&](uint32_t neighbor) { --neighborCounts[neighbor]; });
+    neighborCounts[id] = 0;
+
+    for (ll t = 0; t < T; ++t) {
+      uint32_t bucket = buckets_per_points[(size_t) id * T + t];
+      touch(t, bucket);
+
+      tables[t].remove(bucket, id);
+      if (tables[t].bucketSize(bucket) == 0) {
+        // The last bucket of the table takes the ID of the erased one, and its estimator the place of the erased one
+        uint32_t last = (uint32_t) tables[t].size() - 1;
+        tables[t].erase(bucket);
+        estimators[t][bucket] = estimators[t][last];
+        estimators[t].pop_back();
+        if (bucket != last) {
+          tables[t].forEachPoint(bucket, [&](uint32_t moved) { buckets_per_points[(size_t) moved * T + t] = bucket; });
+        }
       }
     }
-    hashes_per_points.push_back(hashes_per_point);
+  }
+
+  // Puts the point of the given ID in the buckets of its T * L hash values, new buckets getting an estimator of 0
+  void attach(uint32_t id, const ll *hash_value, BucketEstimators &estimators) {
+    for (ll t = 0; t < T; ++t) {
+      uint32_t bucket = tables[t].insert(hash_value + t * L);
+      tables[t].add(bucket, id);
+      buckets_per_points[(size_t) id * T + t] = bucket;
+      estimators[t].resize(tables[t].size(), 0);
+      touch(t, bucket);
+    }
+
+    ll count = 0;
+    forEachNeighbor(id, scratch, [&](uint32_t neighbor) {
+      ++count;
+      ++neighborCounts[neighbor];
+    });
+    neighborCounts[id] = count;
+  }
+
+  // Estimator of a bucket from the neighbor counts of its points
+  float bucketEstimator(ll t, uint32_t bucket) const {
+    return estimator(tables[t].bucketSize(bucket), bucketNeighbors(t, bucket));
+  }
+
+public:
+  // Estimator of a bucket of EA points whose neighbor counts sum to neighbors: EA / EB, EB being the average number
+  // of neighbors of its points
+  static float estimator(ld EA, ld neighbors) {
+    ld EB = neighbors / EA;
+    return EB > 0 ? (float) (EA / EB) : 0;
+  }
+
+  // Sum of the neighbor counts of the points of a bucket, as of the last estimatePerHash or updateEstimators
+  ll bucketNeighbors(ll t, uint32_t bucket) const {
+    ll neighbors = 0;
+    tables[t].forEachPoint(bucket, [&](uint32_t id) { neighbors += neighborCounts[id]; });
+    return neighbors;
+  }
+
+  // Bucket of table t with the given hash value, added empty if there is none
+  // For tables assembled from bucket statistics rather than points, as by LSHAD::mergeShards
+  uint32_t addBucket(ll t, const ll *hash_value) {
+    return tables[t].insert(hash_value);
+  }
+
+  // Sizes of the buckets of table t
+  BucketStats bucketStats(ll t) const {
+    BucketStats stats;
+    stats.buckets = tables[t].size();
+    for (uint32_t bucket = 0; bucket < (uint32_t) tables[t].size(); ++bucket) {
+      ll size = tables[t].bucketSize(bucket);
+      if (size == 0) {
+        continue;
+      }
+      ll k = 63 - __builtin_clzll((unsigned long long) size);
+      if ((ll) stats.histogram.size() <= k) {
+        stats.histogram.resize(k + 1, 0);
+      }
+      stats.histogram[k]++;
+      stats.maxBucketSize = max(stats.maxBucketSize, size);
+    }
+    return stats;
+  }
+
+  // Bytes held by the hash tables: their maps, the IDs in their buckets, and the buckets and neighbor count of every
+  // point
+  size_t tableBytes() const {
+    size_t bytes = buckets_per_points.capacity() * sizeof(uint32_t) + neighborCounts.capacity() * sizeof(ll);
+    for (const auto &table : tables) {
+      bytes += table.bytes();
+    }
+    return bytes;
+  }
+
+  // Bytes held by the stored points
+  size_t pointBytes() const {
+    return points.bytes() + sparsePoints.bytes();
   }
 
   // Gets the total number of buckets in the hash tables and the sum of the sizes of all buckets
@@ -169,73 +802,154 @@ public:
     ll sumBucketSizes = 0;
 
     for (const auto &table: tables) {
-      for (const auto &bucket: table) {
+      for (uint32_t bucket = 0; bucket < (uint32_t) table.size(); ++bucket) {
         numberBuckets++;
-        sumBucketSizes += bucket.second.size();
+        sumBucketSizes += table.bucketSize(bucket);
       }
     }
 
     return make_pair(numberBuckets, sumBucketSizes);
   }
 
-  ll countNeighbors(const vector<ld> &point){
-    ll count = 0;
+  // Counts the distinct points sharing at least one bucket with the point of the given ID,
+  // visiting only the T buckets the point landed in
+  ll countNeighbors(uint32_t id){
+    return countNeighbors(id, scratch);
+  }
+
+  BucketEstimators HashAndEstimatePerHash(const vector<vector<Real>> &data) {
+    //Hashing the data points
+    insertBatch(data);
+
+    return estimatePerHash();
+  }
+
+  // Computes the estimator of every bucket from the points inserted so far
+  BucketEstimators estimatePerHash() {
+    // Number of neighbors of each point, computed once instead of once per table
+    neighborCounts.assign(size(), 0);
+    vector<NeighborScratch> scratches(resolveThreads(threads));
+    parallelFor(size(), threads, 256, [&](ll begin, ll end, ll worker) {
+      for (ll id = begin; id < end; ++id) {
+        neighborCounts[id] = countNeighbors((uint32_t) id, scratches[worker]);
+      }
+    });
 
-    // Using a set to store the neighbors without duplicates
-    unordered_set<vector<ld>, VectorHash, VectorEqual> neighbors;
-    neighbors.insert(point);
-    // Go trough all the tables
-    for (const auto &table: tables){
-      // Go through all the buckets in the hash table
-      for (const auto& bucket : table) {
-        // Find the point in the bucket
-        auto finded = find(bucket.second.begin(), bucket.second.end(), point);
-        // If the point is in the bucket, insert all the points in the bucket in the neighbors set
-        if(finded != bucket.second.end()){
-          neighbors.insert(bucket.second.begin(), bucket.second.end());
+    // Generating the estimator for each hash table
+    BucketEstimators estimators(T);
+    parallelFor(T, threads, 1, [&](ll t0, ll t1, ll) {
+      for (ll t = t0; t < t1; ++t) {
+        estimators[t].resize(tables[t].size());
+        for (uint32_t bucket = 0; bucket < (uint32_t) tables[t].size(); ++bucket) {
+          estimators[t][bucket] = bucketEstimator(t, bucket);
         }
       }
-    }
+    });
 
-    // Return the number of neighbors
-    return neighbors.size() - 1;
+    return estimators;
   }
 
-  unordered_map<InnerHash, ld, InnerMapHash, InnerMapEqual> HashAndEstimatePerHash(const vector<vector<ld>> &data) {
-    // Unordered map personalized for mapping each hash table to its estimator
-
-    unordered_map<InnerHash, ld, InnerMapHash, InnerMapEqual> estPerHash;
+  // Refreshes the estimators after the points from ID first onwards were inserted into trained tables
+  // The neighbor counts stay exact: new points get theirs counted, and every older point sharing a bucket with a new
+  // point gains one neighbor per new point. Only the buckets the new points landed in get their estimators
+  // recomputed, buckets that merely share points with them keep their estimators until the next estimatePerHash
+  void updateEstimators(uint32_t first, BucketEstimators &estimators) {
+    neighborCounts.resize(size(), 0);
+    for (uint32_t id = first; id < (uint32_t) size(); ++id) {
+      ll count = 0;
+      forEachNeighbor(id, scratch, [&](uint32_t neighbor) {
+        ++count;
+        if (neighbor < first) {
+          ++neighborCounts[neighbor];
+        }
+      });
+      neighborCounts[id] = count;
+    }
 
-    //Hashing the data points
-    for (ll i = 0; i < (ll) data.size(); ++i) {
-      insert(data[i]);
+    // Buckets the new points landed in
+    vector<pair<ll, uint32_t>> &touched = touchedBuckets;
+    touched.clear();
+    for (uint32_t id = first; id < (uint32_t) size(); ++id) {
+      for (ll t = 0; t < T; ++t) {
+        touched.emplace_back(t, getBucketsOfPoint(id)[t]);
+      }
     }
+    sort(touched.begin(), touched.end());
+    touched.erase(unique(touched.begin(), touched.end()), touched.end());
 
-    // Generating the estimator for each hash table
-    for (const auto& table: tables) {
-      ld EA = 0.0, EB = 0.0;
+    for (ll t = 0; t < T; ++t) {
+      estimators[t].resize(tables[t].size(), 0);
+    }
+    for (const auto &bucket : touched) {
+      estimators[bucket.first][bucket.second] = bucketEstimator(bucket.first, bucket.second);
+    }
+  }
 
-      for (const auto& bucket : table) {
-        // Calculating the number of elements in the bucket
-        EA = bucket.second.size();
+  // Inserts n row-major points keeping at most window points in the tables, so memory stays flat on an endless stream
+  // Until the window is full points are added as by insertBatch; after that each point takes the ID of the oldest one,
+  // which is first removed from its buckets. Buckets left empty are erased along with their estimators. Neighbor
+  // counts stay exact and, as in updateEstimators, only the buckets points entered or left get their estimators
+  // recomputed. A model holding more points than window keeps that many
+  // Windows are for dense points only
+  // Writes the IDs assigned to the points to ids, if not null
+  // Once the window is full and the scratch buffers have grown to the size of the batches, nothing is allocated
+  void insertWindowed(const Real *x, ll n, ll window, BucketEstimators &estimators, uint32_t *ids = nullptr) {
+    ll appended = min(n, max(0LL, window - points.size()));
+    if (appended > 0) {
+      uint32_t first = (uint32_t) points.size();
+      insertBatch(x, appended);
+      updateEstimators(first, estimators);
+      for (ll i = 0; ids != nullptr && i < appended; ++i) {
+        ids[i] = first + (uint32_t) i;
+      }
+    }
+    if (appended == n) {
+      return;
+    }
 
-        // Calculating the number of neighbors of each element in the bucket
-        for (const auto& point : bucket.second) {
-          ll neighborCount = countNeighbors(point);
-          EB += neighborCount;
-        }
-        // Computing the EB estimator
-        EB = EB / EA;
-        estPerHash[bucket.first] = EB > 0 ? EA / EB : 0;
+    ll count = n - appended;
+    if ((ll) hash_values.size() < count * T * L) {
+      hash_values.resize(count * T * L);
+    }
+    hashBatch(x + appended * DIM, count, hash_values.data());
+
+    touchedKeys.clear();
+    for (ll i = 0; i < count; ++i) {
+      uint32_t id = oldest;
+      oldest = (oldest + 1) % (uint32_t) points.size();
+      detach(id, estimators);
+      points.set(id, x + (appended + i) * DIM);
+      attach(id, hash_values.data() + i * T * L, estimators);
+      if (ids != nullptr) {
+        ids[appended + i] = id;
       }
     }
 
-    return estPerHash;
+    // Refreshes every bucket points entered or left once, visiting the records in table and hash value order
+    ll record = L + 1;
+    touchedOrder.resize(touchedKeys.size() / record);
+    for (uint32_t r = 0; r < (uint32_t) touchedOrder.size(); ++r) {
+      touchedOrder[r] = r;
+    }
+    auto key = [&](uint32_t r) { return touchedKeys.data() + (size_t) r * record; };
+    sort(touchedOrder.begin(), touchedOrder.end(), [&](uint32_t a, uint32_t b) {
+      return lexicographical_compare(key(a), key(a) + record, key(b), key(b) + record);
+    });
+    for (size_t k = 0; k < touchedOrder.size(); ++k) {
+      if (k > 0 && equal(key(touchedOrder[k]), key(touchedOrder[k]) + record, key(touchedOrder[k - 1]))) {
+        continue;
+      }
+      ll t = key(touchedOrder[k])[0];
+      ll found = tables[t].find(key(touchedOrder[k]) + 1);
+      if (found >= 0) {
+        estimators[t][found] = bucketEstimator(t, (uint32_t) found);
+      }
+    }
   }
 
   // ONLY FOR TESTING PURPOSES
-  unordered_set<vector<ld>, VectorHash, VectorEqual> search(const vector<ld> &x) {
-    unordered_set<vector<ld>, VectorHash, VectorEqual> results;
+  unordered_set<vector<Real>, VectorHash, VectorEqual> search(const vector<Real> &x) {
+    unordered_set<vector<Real>, VectorHash, VectorEqual> results;
 
     // For each of the T hash tables...
     for (ll t = 0; t < T; ++t) {
@@ -243,27 +957,24 @@ public:
       vector<ll> hash_value = hash(x, t);
 
       // Collects all data points that shares the same bucket as our query data point...
-      auto bucket = tables[t].find(hash_value);
-      if (bucket != tables[t].end()) {
-        results.insert(bucket->second.begin(), bucket->second.end());
+      ll bucket = tables[t].find(hash_value);
+      if (bucket >= 0) {
+        tables[t].forEachPoint(bucket, [&](uint32_t id) { results.insert(points.get(id)); });
       }
     }
 
     return results;
   }
 
-  vector<InnerHash> search_tables(const vector<ld> &x) {
+  vector<InnerHash> search_tables(const vector<Real> &x) {
     vector<InnerHash> results;
 
-    cout << "Cantidad de tablas: " << T << "\n";
+    vector<ll> hash_value(T * L);
+    hashBatch(x.data(), 1, hash_value.data());
     for (ll t = 0; t < T; ++t) {
-      vector<ll> hash_value = hash(x, t);
-
-      for (ll l = 0; l < L; ++l) {
-        auto it = tables[t].find(hash_value);
-        if (it != tables[t].end()) {
-          results.push_back(it->first);
-        }
+      const ll *table_hash = hash_value.data() + t * L;
+      if (tables[t].find(table_hash) >= 0) {
+        results.emplace_back(table_hash, table_hash + L);
       }
     }
 
@@ -0,0 +1,425 @@
+#pragma once
+
+#include <chrono>
+#include <climits>
+#include <random>
+#include "HashTables2.h"
+#include "DataSource.h"
+
+using namespace std;
+
+// Bucket occupancy measured for one w candidate
+struct WProbe {
+  ld w;
+  // (sumBucketSizes / BC) / |data|
+  ld averageBucketSize;
+  // Time spent counting the buckets of the candidate, summed over its T tables
+  double seconds;
+  // Round of concurrent probes the candidate was evaluated in
+  ll round;
+};
+
+// Hyperparameters chosen by the tuner, along with every probe it evaluated
+struct TuningReport {
+  ll L, T;
+  ld w;
+  ld averageBucketSize;
+  vector<WProbe> probes;
+  double projectionSeconds;
+  double totalSeconds;
+  // Number of points the occupancy was measured on
+  ll sampleSize;
+};
+
+// Number of tables and buckets probed per table evaluated by LSHAD::tuneTables
+struct TableCandidate {
+  ll T;
+  ll probes;
+  // F1 score of the anomaly flags of the validation points against their labels, on the half the candidates are
+  // chosen on and on the held-out half, averaged over projection seeds
+  ld f1;
+  ld heldOutF1;
+  size_t bytes;
+  // Time taken to score the whole validation set, averaged over projection seeds
+  double scoringSeconds;
+};
+
+struct TableTuningReport {
+  ll T;
+  ll probes;
+  vector<TableCandidate> candidates;
+};
+
+// Limits on the models considered by LSHAD::tuneShape, 0 meaning no limit, and the shapes it tries
+struct TuningBudget {
+  size_t maxModelBytes = 0;
+  double maxSecondsPerPoint = 0;
+  vector<ll> Ls = {2, 3, 4, 6, 8};
+  vector<ll> Ts = {10, 20, 30, 50, 80};
+};
+
+// Model of L hash values per table and T tables, with w tuned for the bucket occupancy target, as measured
+struct ShapeCandidate {
+  ll L, T;
+  ld w;
+  ld averageBucketSize;
+  // F1 score of the anomaly flags of the validation points against their labels, on the half the shape is chosen on
+  // and on the held-out half, averaged over projection seeds
+  ld f1;
+  ld heldOutF1;
+  size_t bytes;
+  double secondsPerPoint;
+  bool withinBudget;
+};
+
+struct ShapeTuningReport {
+  ll L, T;
+  ld w;
+  vector<ShapeCandidate> candidates;
+  // Candidates no other candidate beats at once on F1, size and scoring time
+  vector<ShapeCandidate> pareto;
+};
+
+// Options of the sampled tuning mode
+struct SamplingOptions {
+  // Size of the first reservoir sample
+  ll sampleSize = 10000;
+  // The sample is doubled while the chosen average bucket size is within this relative distance of a band edge
+  ld tolerance = 0.1;
+  // Largest sample drawn, 0 meaning up to the whole data
+  ll maxSampleSize = 0;
+  // Seed of the sampling and of the projections, 0 meaning a random one
+  uint64_t seed = 0;
+};
+
+// Searches for the w whose average bucket size falls in [lowTarget, highTarget] of the data size
+// The data is projected once: with beta drawn as a fraction of w, the hash value of a projection for any w is
+// floor(dot(x, alpha) / w + offset), so every candidate is evaluated from the same raw projections
+// Several candidates are evaluated concurrently in each round, which narrows the search interval faster
+template <typename Real = ld>
+class HyperparameterTuner {
+private:
+  ll L, T, n;
+  ll threads;
+
+  // Number of w candidates evaluated concurrently per round
+  ll probesPerRound;
+  ll maxRounds = 64;
+
+  // Target band of the average bucket size, relative to the data size
+  ld lowTarget = 0.05, highTarget = 0.1;
+
+  // Smallest w searched. On small or tightly packed data a w below 1 can meet the band with every point in a bucket
+  // of its own, where every point gets the same score, so as the original search w never goes below 1
+  static constexpr ld MIN_W = 1;
+
+  // Raw projections dot(x, alpha) of every point, T * L per point, held as float whatever Real is: they only decide
+  // bucket occupancy, and at T * L values per point they are by far the largest thing the tuner holds
+  vector<float> dots;
+
+  // Offset of every projection, as a fraction of w
+  vector<Real> offsets;
+
+  double projectionSeconds = 0;
+
+  static double secondsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  }
+
+  bool inBand(ld averageBucketSize) const {
+    return averageBucketSize >= lowTarget && averageBucketSize <= highTarget;
+  }
+
+  // Indices of k points drawn uniformly without replacement from n (reservoir sampling, Algorithm R)
+  static vector<ll> reservoirSample(ll n, ll k, CounterRng &generator) {
+    vector<ll> reservoir(min(n, k));
+    for (ll i = 0; i < (ll) reservoir.size(); ++i) {
+      reservoir[i] = i;
+    }
+    for (ll i = k; i < n; ++i) {
+      ll j = (ll) generator.below(i + 1);
+      if (j < k) {
+        reservoir[j] = i;
+      }
+    }
+    sort(reservoir.begin(), reservoir.end());
+    return reservoir;
+  }
+
+public:
+  // Projections drawn from a seed other than 0 are those of a ProjectionMatrix of the same seed, so the tuned w
+  // is measured on the very projections of a model built with that seed
+  HyperparameterTuner(const vector<vector<Real>> &data, ll L, ll T, ll threads = 1, ll probesPerRound = 0,
+                      uint64_t seed = 0)
+      : L(L), T(T), n((ll) data.size()), threads(threads),
+        probesPerRound(probesPerRound > 0 ? probesPerRound : max(4LL, resolveThreads(threads))) {
+    auto start = chrono::steady_clock::now();
+
+    // Projections generated for w = 1 have their beta uniform in [0, 1], i.e. the offset as a fraction of w
+    ProjectionMatrix<Real> projections(T, L, (ll) data[0].size(), 1, 1, seed);
+    offsets.resize(T * L);
+    for (ll r = 0; r < T * L; ++r) {
+      offsets[r] = projections.beta(r);
+    }
+
+    dots.resize(n * T * L);
+    parallelFor(n, threads, 256, [&](ll begin, ll end, ll) {
+      vector<Real> projected(T * L);
+      for (ll i = begin; i < end; ++i) {
+        projections.project(data[i].data(), 1, projected.data());
+        copy(projected.begin(), projected.end(), dots.begin() + i * T * L);
+      }
+    });
+
+    projectionSeconds = secondsSince(start);
+  }
+
+  // Same over sparse points, projected in O(nnz) each by very sparse projections of the given density
+  HyperparameterTuner(const SparseRows<Real> &data, ll L, ll T, ld density, ll threads = 1, ll probesPerRound = 0,
+                      uint64_t seed = 0)
+      : L(L), T(T), n(data.size()), threads(threads),
+        probesPerRound(probesPerRound > 0 ? probesPerRound : max(4LL, resolveThreads(threads))) {
+    auto start = chrono::steady_clock::now();
+
+    ProjectionMatrix<Real> projections(T, L, data.dim(), 1, density, seed);
+    offsets.resize(T * L);
+    for (ll r = 0; r < T * L; ++r) {
+      offsets[r] = projections.beta(r);
+    }
+
+    dots.resize(n * T * L);
+    parallelFor(n, threads, 256, [&](ll begin, ll end, ll) {
+      vector<Real> projected(T * L);
+      for (ll i = begin; i < end; ++i) {
+        projections.view().project(data, i, 1, projected.data());
+        copy(projected.begin(), projected.end(), dots.begin() + i * T * L);
+      }
+    });
+
+    projectionSeconds = secondsSince(start);
+  }
+
+  void setTargets(ld low, ld high) {
+    lowTarget = low;
+    highTarget = high;
+  }
+
+  void setMaxRounds(ll rounds) {
+    maxRounds = rounds;
+  }
+
+  // Evaluates the average bucket size of every candidate, counting the buckets of each (candidate, table) concurrently
+  vector<WProbe> probe(const vector<ld> &candidates, ll round = 0) const {
+    ll C = (ll) candidates.size();
+    vector<ll> buckets(C * T);
+    vector<double> seconds(C * T);
+
+    parallelFor(C * T, threads, 1, [&](ll begin, ll end, ll) {
+      vector<ll> hash_value(L);
+      for (ll task = begin; task < end; ++task) {
+        auto start = chrono::steady_clock::now();
+        Real w = (Real) candidates[task / T];
+        ll t = task % T;
+
+        FlatHashMap<char> table(L);
+        for (ll i = 0; i < n; ++i) {
+          const float *dot = dots.data() + i * T * L + t * L;
+          for (ll l = 0; l < L; ++l) {
+            hash_value[l] = (ll) floor((Real) dot[l] / w + offsets[t * L + l]);
+          }
+          table.insert(hash_value.data());
+        }
+
+        buckets[task] = table.size();
+        seconds[task] = secondsSince(start);
+      }
+    });
+
+    vector<WProbe> probes(C);
+    for (ll c = 0; c < C; ++c) {
+      ll BC = 0;
+      double time = 0;
+      for (ll t = 0; t < T; ++t) {
+        BC += buckets[c * T + t];
+        time += seconds[c * T + t];
+      }
+      // Every point lands in one bucket per table, so sumBucketSizes is n * T
+      ld averageBucketSize = ((ld) (n * T) / (ld) BC) / (ld) n;
+      probes[c] = {candidates[c], averageBucketSize, time, round};
+    }
+    return probes;
+  }
+
+  TuningReport tune() const {
+    auto start = chrono::steady_clock::now();
+    TuningReport report{L, T, 0, 0, {}, projectionSeconds, 0, n};
+
+    auto finish = [&](const WProbe &chosen) {
+      report.w = chosen.w;
+      report.averageBucketSize = chosen.averageBucketSize;
+      report.totalSeconds = projectionSeconds + secondsSince(start);
+      return report;
+    };
+
+    // Largest w known to give buckets below the band, or MIN_W, and smallest w known to give buckets above it
+    ld below = MIN_W, above = -1;
+    ll round = 0;
+
+    // Expanding phase: probes w, 2w, 4w, ... until some candidate reaches the band
+    for (ld w = MIN_W; above < 0 && round < maxRounds; ++round) {
+      vector<ld> candidates;
+      for (ll c = 0; c < probesPerRound; ++c, w *= 2) {
+        candidates.push_back(w);
+      }
+
+      for (const auto &p : probe(candidates, round)) {
+        report.probes.push_back(p);
+        if (inBand(p.averageBucketSize)) {
+          return finish(p);
+        }
+        if (above > 0) {
+          continue;
+        }
+        if (p.averageBucketSize < lowTarget) {
+          below = p.w;
+        } else {
+          above = p.w;
+        }
+      }
+    }
+
+    // Narrowing phase: probes evenly spaced candidates strictly inside (below, above), none if MIN_W is already above
+    for (; above > below && round < maxRounds; ++round) {
+      vector<ld> candidates;
+      for (ll c = 1; c <= probesPerRound; ++c) {
+        candidates.push_back(below + (above - below) * c / (probesPerRound + 1));
+      }
+
+      ld nextBelow = below, nextAbove = above;
+      for (const auto &p : probe(candidates, round)) {
+        report.probes.push_back(p);
+        if (inBand(p.averageBucketSize)) {
+          return finish(p);
+        }
+        if (p.averageBucketSize < lowTarget) {
+          nextBelow = max(nextBelow, p.w);
+        } else {
+          nextAbove = min(nextAbove, p.w);
+        }
+      }
+      below = nextBelow;
+      above = nextAbove;
+    }
+
+    // No candidate fell in the band, so the closest one is chosen
+    auto distance = [&](const WProbe &p) {
+      return p.averageBucketSize < lowTarget ? lowTarget - p.averageBucketSize : p.averageBucketSize - highTarget;
+    };
+    return finish(*min_element(report.probes.begin(), report.probes.end(), [&](const WProbe &a, const WProbe &b) {
+      return distance(a) < distance(b);
+    }));
+  }
+
+  // Number of points read at a time when sampling a data source
+  static constexpr ll STREAM_CHUNK = 65536;
+
+  // Stream of the seed the samples are drawn from, apart from the streams of the rows of the projections
+  static constexpr uint64_t SAMPLING_STREAM = UINT64_MAX;
+
+  // Reservoir sample of k points from a data source, in one pass over it; n is set to the number of points read
+  static vector<vector<Real>> reservoirSample(DataSource<Real> &source, ll k, CounterRng &generator, ll &n) {
+    vector<vector<Real>> reservoir;
+    vector<Real> rows;
+    n = 0;
+    source.rewind();
+    for (ll count = source.next(rows, STREAM_CHUNK); count > 0; count = source.next(rows, STREAM_CHUNK)) {
+      ll dim = source.dim();
+      for (ll i = 0; i < count; ++i, ++n) {
+        const Real *row = rows.data() + i * dim;
+        if (n < k) {
+          reservoir.emplace_back(row, row + dim);
+        } else {
+          ll j = (ll) generator.below(n + 1);
+          if (j < k) {
+            reservoir[j].assign(row, row + dim);
+          }
+        }
+      }
+    }
+    return reservoir;
+  }
+
+  // Tunes w on samples returned by drawSample(k, generator, n), which also sets n to the size of the data
+  // The average bucket size is a coarse statistic, so a sample of a few thousand points estimates it well; the sample
+  // is only grown (doubled) while the chosen w lands within options.tolerance of an edge of the target band
+  template <typename DrawSample>
+  static TuningReport tuneOnSamples(DrawSample drawSample, ll L, ll T, ll threads, const SamplingOptions &options,
+                                    ld lowTarget, ld highTarget) {
+    auto start = chrono::steady_clock::now();
+    // Drawn from CounterRng rather than <random>, whose distributions differ between standard libraries, so a seed
+    // gives the same sample, and so the same w, on every platform
+    CounterRng generator(resolveSeed(options.seed), SAMPLING_STREAM);
+
+    vector<WProbe> probes;
+    for (ll sampleSize = options.sampleSize;;) {
+      ll n = 0;
+      vector<vector<Real>> sample = drawSample(sampleSize, generator, n);
+      ll limit = options.maxSampleSize > 0 ? min(n, options.maxSampleSize) : n;
+
+      HyperparameterTuner tuner(sample, L, T, threads, 0, options.seed);
+      tuner.setTargets(lowTarget, highTarget);
+      TuningReport report = tuner.tune();
+      probes.insert(probes.end(), report.probes.begin(), report.probes.end());
+
+      ld margin = options.tolerance;
+      bool nearEdge = fabsl(report.averageBucketSize - lowTarget) < margin * lowTarget ||
+                      fabsl(report.averageBucketSize - highTarget) < margin * highTarget;
+      if (!nearEdge || (ll) sample.size() >= limit) {
+        report.probes = probes;
+        report.totalSeconds = secondsSince(start);
+        return report;
+      }
+      sampleSize = min(limit, sampleSize * 2);
+    }
+  }
+
+  // Tunes w on a reservoir sample of the data instead of the whole of it
+  static TuningReport tuneSampled(const vector<vector<Real>> &data, ll L, ll T, ll threads,
+                                  const SamplingOptions &options, ld lowTarget = 0.05, ld highTarget = 0.1) {
+    auto drawSample = [&](ll k, CounterRng &generator, ll &n) {
+      n = (ll) data.size();
+      k = options.maxSampleSize > 0 ? min(k, options.maxSampleSize) : k;
+      vector<vector<Real>> sample;
+      for (ll i : reservoirSample(n, k, generator)) {
+        sample.push_back(data[i]);
+      }
+      return sample;
+    };
+    return tuneOnSamples(drawSample, L, T, threads, options, lowTarget, highTarget);
+  }
+
+  // Tunes w on a reservoir sample of a data source, read in a single pass: the largest sample that may be needed
+  // (options.maxSampleSize points, or the whole source if 0) is drawn first, and the smaller ones are drawn from it,
+  // a uniform sample of a uniform sample being a uniform sample of the source
+  static TuningReport tuneSampled(DataSource<Real> &source, ll L, ll T, ll threads,
+                                  const SamplingOptions &options, ld lowTarget = 0.05, ld highTarget = 0.1) {
+    vector<vector<Real>> largest;
+    ll total = -1;
+    auto drawSample = [&](ll k, CounterRng &generator, ll &n) {
+      if (total < 0) {
+        largest = reservoirSample(source, options.maxSampleSize > 0 ? options.maxSampleSize : LLONG_MAX, generator,
+                                  total);
+      }
+      n = total;
+      if (k >= (ll) largest.size()) {
+        return largest;
+      }
+      vector<vector<Real>> sample;
+      for (ll i : reservoirSample((ll) largest.size(), k, generator)) {
+        sample.push_back(largest[i]);
+      }
+      return sample;
+    };
+    return tuneOnSamples(drawSample, L, T, threads, options, lowTarget, highTarget);
+  }
+};
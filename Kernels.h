@@ -0,0 +1,217 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <type_traits>
+#include "hashes.h"
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// Numeric kernels of the hashing path, generic over the coordinate type
+// The float and double versions use AVX-512 or AVX2 when the compiler targets them (-mavx2, -mavx512f, -march=native)
+
+template <typename Real>
+inline Real dot_product(const Real *v1, const Real *v2, ll n) {
+  Real result = 0;
+
+  for (ll i = 0; i < n; ++i) {
+    result += v1[i] * v2[i];
+  }
+
+  return result;
+}
+
+#if defined(__AVX512F__)
+template <>
+inline double dot_product<double>(const double *v1, const double *v2, ll n) {
+  __m512d sum = _mm512_setzero_pd();
+  ll i = 0;
+  for (; i < n - n % 8; i += 8) {
+    sum = _mm512_fmadd_pd(_mm512_loadu_pd(v1 + i), _mm512_loadu_pd(v2 + i), sum);
+  }
+  double result = _mm512_reduce_add_pd(sum);
+  for (; i < n; ++i) {
+    result += v1[i] * v2[i];
+  }
+  return result;
+}
+
+template <>
+inline float dot_product<float>(const float *v1, const float *v2, ll n) {
+  __m512 sum = _mm512_setzero_ps();
+  ll i = 0;
+  for (; i < n - n % 16; i += 16) {
+    sum = _mm512_fmadd_ps(_mm512_loadu_ps(v1 + i), _mm512_loadu_ps(v2 + i), sum);
+  }
+  float result = _mm512_reduce_add_ps(sum);
+  for (; i < n; ++i) {
+    result += v1[i] * v2[i];
+  }
+  return result;
+}
+#elif defined(__AVX2__)
+template <>
+inline double dot_product<double>(const double *v1, const double *v2, ll n) {
+  __m256d sum = _mm256_setzero_pd();
+  ll i = 0;
+  for (; i < n - n % 4; i += 4) {
+#if defined(__FMA__)
+    sum = _mm256_fmadd_pd(_mm256_loadu_pd(v1 + i), _mm256_loadu_pd(v2 + i), sum);
+#else
+    sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_loadu_pd(v1 + i), _mm256_loadu_pd(v2 + i)));
+#endif
+  }
+  __m128d half = _mm_add_pd(_mm256_castpd256_pd128(sum), _mm256_extractf128_pd(sum, 1));
+  double result = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+  for (; i < n; ++i) {
+    result += v1[i] * v2[i];
+  }
+  return result;
+}
+
+template <>
+inline float dot_product<float>(const float *v1, const float *v2, ll n) {
+  __m256 sum = _mm256_setzero_ps();
+  ll i = 0;
+  for (; i < n - n % 8; i += 8) {
+#if defined(__FMA__)
+    sum = _mm256_fmadd_ps(_mm256_loadu_ps(v1 + i), _mm256_loadu_ps(v2 + i), sum);
+#else
+    sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(v1 + i), _mm256_loadu_ps(v2 + i)));
+#endif
+  }
+  __m128 quarter = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+  quarter = _mm_add_ps(quarter, _mm_movehl_ps(quarter, quarter));
+  float result = _mm_cvtss_f32(_mm_add_ss(quarter, _mm_movehdup_ps(quarter)));
+  for (; i < n; ++i) {
+    result += v1[i] * v2[i];
+  }
+  return result;
+}
+#endif
+
+// Dot product of a dimension known at compile time, fully unrolled so the coordinates stay in registers
+// Long vectors go to the SIMD kernel above, whose loop the constant length lets the compiler unroll
+template <ll Dim, typename Real>
+inline Real dot_product_fixed(const Real *v1, const Real *v2) {
+  if constexpr (Dim >= 16) {
+    return dot_product(v1, v2, Dim);
+  }
+  Real result = 0;
+
+#pragma GCC unroll 64
+  for (ll i = 0; i < Dim; ++i) {
+    result += v1[i] * v2[i];
+  }
+
+  return result;
+}
+
+template <typename Real>
+inline Real dot_product(const vector<Real> &v1, const vector<Real> &v2) {
+  return dot_product(v1.data(), v2.data(), (ll) v1.size());
+}
+
+// Quantizes n projections into hash values: floor((projected + beta) / w)
+template <typename Real>
+inline void quantize(const Real *projected, const Real *betas, ll n, Real w, ll *hash_values) {
+  for (ll r = 0; r < n; ++r) {
+    hash_values[r] = (ll) floor((projected[r] + betas[r]) / w);
+  }
+}
+
+#if defined(__AVX512F__)
+template <>
+inline void quantize<double>(const double *projected, const double *betas, ll n, double w, ll *hash_values) {
+  const __m512d width = _mm512_set1_pd(w);
+  alignas(64) double floored[8];
+  ll r = 0;
+  for (; r + 8 <= n; r += 8) {
+    __m512d q = _mm512_div_pd(_mm512_add_pd(_mm512_loadu_pd(projected + r), _mm512_loadu_pd(betas + r)), width);
+    _mm512_store_pd(floored, _mm512_roundscale_pd(q, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC));
+    for (int k = 0; k < 8; ++k) {
+      hash_values[r + k] = (ll) floored[k];
+    }
+  }
+  for (; r < n; ++r) {
+    hash_values[r] = (ll) floor((projected[r] + betas[r]) / w);
+  }
+}
+
+template <>
+inline void quantize<float>(const float *projected, const float *betas, ll n, float w, ll *hash_values) {
+  const __m512 width = _mm512_set1_ps(w);
+  alignas(64) float floored[16];
+  ll r = 0;
+  for (; r + 16 <= n; r += 16) {
+    __m512 q = _mm512_div_ps(_mm512_add_ps(_mm512_loadu_ps(projected + r), _mm512_loadu_ps(betas + r)), width);
+    _mm512_store_ps(floored, _mm512_roundscale_ps(q, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC));
+    for (int k = 0; k < 16; ++k) {
+      hash_values[r + k] = (ll) floored[k];
+    }
+  }
+  for (; r < n; ++r) {
+    hash_values[r] = (ll) floor((projected[r] + betas[r]) / w);
+  }
+}
+#elif defined(__AVX2__)
+template <>
+inline void quantize<double>(const double *projected, const double *betas, ll n, double w, ll *hash_values) {
+  const __m256d width = _mm256_set1_pd(w);
+  alignas(32) double floored[4];
+  ll r = 0;
+  for (; r + 4 <= n; r += 4) {
+    __m256d q = _mm256_div_pd(_mm256_add_pd(_mm256_loadu_pd(projected + r), _mm256_loadu_pd(betas + r)), width);
+    _mm256_store_pd(floored, _mm256_floor_pd(q));
+    for (int k = 0; k < 4; ++k) {
+      hash_values[r + k] = (ll) floored[k];
+    }
+  }
+  for (; r < n; ++r) {
+    hash_values[r] = (ll) floor((projected[r] + betas[r]) / w);
+  }
+}
+
+template <>
+inline void quantize<float>(const float *projected, const float *betas, ll n, float w, ll *hash_values) {
+  const __m256 width = _mm256_set1_ps(w);
+  alignas(32) float floored[8];
+  ll r = 0;
+  for (; r + 8 <= n; r += 8) {
+    __m256 q = _mm256_div_ps(_mm256_add_ps(_mm256_loadu_ps(projected + r), _mm256_loadu_ps(betas + r)), width);
+    _mm256_store_ps(floored, _mm256_floor_ps(q));
+    for (int k = 0; k < 8; ++k) {
+      hash_values[r + k] = (ll) floored[k];
+    }
+  }
+  for (; r < n; ++r) {
+    hash_values[r] = (ll) floor((projected[r] + betas[r]) / w);
+  }
+}
+#endif
+
+// Shapes the kernels are compiled for: the dimensions of the models run in production and the L the tuner searches
+// Any other shape runs the generic kernels, compiled as the shape 0
+template <ll... Values>
+struct Shapes {};
+using SpecializedDims = Shapes<2, 3, 4, 8, 16, 32>;
+using SpecializedLs = Shapes<2, 3, 4, 6, 8>;
+
+// Returns fn(integral_constant<ll, V>()) for the value V of the shapes equal to value, or
+// fn(integral_constant<ll, 0>()) if there is none
+template <typename Fn>
+inline auto dispatchShape(ll, Shapes<>, Fn fn) {
+  return fn(integral_constant<ll, 0>());
+}
+
+template <ll First, ll... Rest, typename Fn>
+inline auto dispatchShape(ll value, Shapes<First, Rest...>, Fn fn) {
+  if (value == First) {
+    return fn(integral_constant<ll, First>());
+  }
+  return dispatchShape(value, Shapes<Rest...>(), fn);
+}
@@ -1,29 +1,483 @@
 #pragma once
 #include "HashTables2.h"
+#include "HyperparameterTuner.h"
+#include "FrozenModel.h"
+#include "QuantileSketch.h"
+#include "Shards.h"
+#include "Stats.h"
 #include "hashes.h"
 #include <unordered_map>
 #include <tuple>
+#include <memory>
+#include <mutex>
+#include <atomic>
 
 using namespace std;
 
+template <typename Real = ld>
 class LSHAD {
-  HashTables *hasher;
-  unordered_map<InnerHash, ld, InnerMapHash, InnerMapEqual> estPerHash;
+  HashTables<Real> *hasher;
+  // Estimator of every bucket of every table
+  BucketEstimators estPerHash;
   ld threshold;
 
+  // Immutable copy of the trained model, used for scoring; published and read with atomic_store and atomic_load
+  shared_ptr<const FrozenLSHADModel<Real>> frozen;
+
+  // Number of threads used for training, 0 meaning one per hardware thread
+  ll threads = 1;
+
+  // Probes evaluated by the last hyperparameter tuning and the values chosen
+  TuningReport tuningReport{};
+
+  // Tuning on a reservoir sample of the data instead of the whole of it, by default of at most 2^18 points, as the
+  // tuner holds T * L projections of every point it tunes on
+  bool sampledTuning = true;
+  SamplingOptions samplingOptions{10000, 0.1, 1 << 18, 0};
+
+  // Hash values per table and number of tables, and buckets probed per table around the bucket of a point when
+  // scoring (multi-probe LSH)
+  ll hashLength = 4;
+  ll tableCount = 50;
+  ll probes = 0;
+
+  // Density of the projections, 0 for dense ones on dense points and very sparse ones on sparse points
+  ld projectionDensity = 0;
+
+  // Seed of the projections and of the tuning samples, 0 for random ones
+  uint64_t seed = 0;
+
+  SamplingOptions seededSampling() const {
+    SamplingOptions options = samplingOptions;
+    if (options.seed == 0) {
+      options.seed = seed;
+    }
+    return options;
+  }
+
+  ld densityFor(ll dim, bool sparse) const {
+    if (projectionDensity > 0) {
+      return projectionDensity;
+    }
+    // Li, Hastie and Church: a density of 1 / sqrt(dim) keeps the projections accurate for well behaved data
+    return sparse ? min((ld) 1, 1 / sqrtl((ld) dim)) : 1;
+  }
+
+  // Capacity of the score sketches, for a rank error of about 0.1% of the points
+  static constexpr ll SKETCH_K = 2000;
+
+  // Points scored into each partial sketch when sketching the scores of the stored points
+  static constexpr ll SCORE_CHUNK = 65536;
+
+  // Anomaly ratio of the last training, and the scores of the points seen so far for keeping the threshold on update
+  ld anomalyRatio = 0;
+  QuantileSketch scoreSketch{SKETCH_K};
+
+  // Phase timings of the last train, see getStats
+  LSHADStats trainingStats;
+
+  // Latency of score_batch calls, collected after setLatencyTracking
+  atomic<bool> latencyTracking{false};
+  mutable mutex latencyMutex;
+  mutable QuantileSketch latencySketch{SKETCH_K};
+  mutable ld maxLatency = 0;
+
+  // Runs score(model) on the current frozen model unless there is no trained model, returning whether it scored
+  // The model is held for the whole call, so an update publishing a new one cannot free it while it scores
+  template <typename Score>
+  bool timedScoring(Score score) const {
+    shared_ptr<const FrozenLSHADModel<Real>> model = getFrozenModel();
+    if (model == nullptr) {
+      return false;
+    }
+    if (!latencyTracking) {
+      return score(*model);
+    }
+    Stopwatch watch;
+    bool scored = score(*model);
+    ld seconds = watch.lap();
+    lock_guard<mutex> lock(latencyMutex);
+    latencySketch.insert(seconds);
+    maxLatency = max(maxLatency, seconds);
+    return scored;
+  }
+
+  // Replaces the frozen model atomically; scoring threads still holding the previous one keep using it
+  void publish(shared_ptr<const FrozenLSHADModel<Real>> model) {
+    atomic_store(&frozen, move(model));
+  }
+
+  // Maximum number of points kept by update, 0 for no limit
+  ll window = 0;
+
+  // With a window, sketches of the scores of consecutive groups of window / 2 points, the last one being filled
+  // The threshold is read from the last WINDOW_SKETCHES of them, which cover between one and one and a half windows
+  static constexpr ll WINDOW_SKETCHES = 3;
+  vector<QuantileSketch> windowSketches;
+  ll lastSketchCount = 0;
+
+  // Points inserted by update since the estimators were last all recomputed
+  ll sinceEstimation = 0;
+
+  // Sketch of the scores the model gives to the points stored in hasher, computed as score_batch does
+  // Chunks of SCORE_CHUNK points are scored concurrently into sketches of their own, which are merged in chunk order
+  // so the result does not depend on the number of threads
+  QuantileSketch sketchStoredScores(const HashTables<Real> &hasher, const FrozenLSHADModel<Real> &model) const {
+    ll n = hasher.size();
+    ll chunks = (n + SCORE_CHUNK - 1) / SCORE_CHUNK;
+    vector<QuantileSketch> partial(chunks, QuantileSketch(SKETCH_K));
+    parallelFor(chunks, threads, 1, [&](ll c0, ll c1, ll) {
+      vector<ld> scores;
+      for (ll c = c0; c < c1; ++c) {
+        ll count = min(n, (c + 1) * SCORE_CHUNK) - c * SCORE_CHUNK;
+        scores.resize(count);
+        if (hasher.isSparse()) {
+          model.score_batch(hasher.getSparsePoints(), c * SCORE_CHUNK, count, scores.data(), nullptr);
+        } else {
+          model.score_batch(hasher.getPoints()[(uint32_t) (c * SCORE_CHUNK)], count, hasher.getDim(), scores.data(),
+                            nullptr);
+        }
+        for (ld score : scores) {
+          partial[c].insert(score);
+        }
+      }
+    });
+
+    QuantileSketch sketch(SKETCH_K);
+    for (const auto &chunk : partial) {
+      sketch.merge(chunk);
+    }
+    return sketch;
+  }
+
+  // Model of tables trained on data, with the threshold at the given ratio of the training scores
+  shared_ptr<const FrozenLSHADModel<Real>> fitModel(const vector<vector<Real>> &data, ll L, ll T, Real w, ll probes,
+                                                    ld anomalyRatio, uint64_t modelSeed) const {
+    HashTables<Real> tables(L, T, w, data[0].size(), densityFor(data[0].size(), false), modelSeed);
+    tables.setThreads(threads);
+    BucketEstimators estimators = tables.HashAndEstimatePerHash(data);
+    auto model = make_shared<FrozenLSHADModel<Real>>(tables, estimators, 0, probes);
+    model->setThreshold(sketchStoredScores(tables, *model).quantile(anomalyRatio));
+    return model;
+  }
+
+  void sketchScore(ld score) {
+    if (window == 0) {
+      scoreSketch.insert(score);
+      return;
+    }
+    if (windowSketches.empty() || lastSketchCount >= max(1LL, window / 2)) {
+      windowSketches.emplace_back(SKETCH_K);
+      lastSketchCount = 0;
+      if ((ll) windowSketches.size() > WINDOW_SKETCHES) {
+        windowSketches.erase(windowSketches.begin());
+      }
+    }
+    windowSketches.back().insert(score);
+    lastSketchCount++;
+  }
+
+  // Tunes w for the bucket occupancy target with L hash values per table and T tables
+  TuningReport tuneWidth(const vector<vector<Real>> &data, ll L, ll T) const {
+    if (sampledTuning) {
+      return HyperparameterTuner<Real>::tuneSampled(data, L, T, threads, seededSampling());
+    }
+    // Projects the data once and searches w over those projections, several candidates per round
+    HyperparameterTuner<Real> tuner(data, L, T, threads, 0, seed);
+    return tuner.tune();
+  }
+
+  // F1 score of the anomaly flags the model gives to the validation points against their labels, and the time
+  // taken to score them
+  ld detectionF1(const FrozenLSHADModel<Real> &model, const vector<vector<Real>> &validation,
+                 const vector<bool> &anomalous, double &seconds) const {
+    vector<Real> rows;
+    for (const auto &point : validation) {
+      rows.insert(rows.end(), point.begin(), point.end());
+    }
+    ll n = (ll) validation.size();
+    vector<ld> scores(n);
+
+    auto start = chrono::high_resolution_clock::now();
+    model.score_batch(rows.data(), n, model.getDim(), scores.data(), nullptr);
+    auto end = chrono::high_resolution_clock::now();
+    seconds = chrono::duration<double>(end - start).count();
+
+    ll truePositives = 0, mismatches = 0;
+    for (ll i = 0; i < n; ++i) {
+      bool flagged = scores[i] <= model.getThreshold();
+      truePositives += flagged && anomalous[i];
+      mismatches += flagged != anomalous[i];
+    }
+    return truePositives + mismatches == 0 ? 1 : 2.0L * truePositives / (2 * truePositives + mismatches);
+  }
+
+  // Labeled validation points split in halves, evenly among anomalies and normal points: models are chosen on the
+  // first half and the choice confirmed on the held-out second one
+  struct ValidationSplit {
+    vector<vector<Real>> tuning, heldOut;
+    vector<bool> tuningLabels, heldOutLabels;
+  };
+
+  static ValidationSplit splitValidation(const vector<vector<Real>> &validation, const vector<bool> &anomalous) {
+    ValidationSplit split;
+    ll seen[2] = {0, 0};
+    for (size_t i = 0; i < validation.size(); ++i) {
+      bool held = seen[anomalous[i]]++ % 2 == 1;
+      (held ? split.heldOut : split.tuning).push_back(validation[i]);
+      (held ? split.heldOutLabels : split.tuningLabels).push_back(anomalous[i]);
+    }
+    return split;
+  }
+
+  // F1 scores on both halves of a split, size and time taken to score the whole validation set of models of a shape
+  // The F1 score of a model varies with its projections, so all are averaged over models of repeats seeds, derived
+  // from the seed of the model so they are reproducible, the first being the seed train uses
+  struct ModelEvaluation {
+    ld f1 = 0, heldOutF1 = 0;
+    size_t bytes = 0;
+    double seconds = 0;
+  };
+
+  ModelEvaluation evaluateModels(const vector<vector<Real>> &data, ll L, ll T, Real w, ll probes, ld anomalyRatio,
+                                 const ValidationSplit &split, ll repeats) const {
+    ModelEvaluation evaluation;
+    for (ll r = 0; r < repeats; ++r) {
+      uint64_t modelSeed = seed == 0 || r == 0 ? seed : mix64(seed + r);
+      auto model = fitModel(data, L, T, w, probes, anomalyRatio, modelSeed);
+      double tuningSeconds, heldOutSeconds;
+      evaluation.f1 += detectionF1(*model, split.tuning, split.tuningLabels, tuningSeconds) / repeats;
+      evaluation.heldOutF1 += detectionF1(*model, split.heldOut, split.heldOutLabels, heldOutSeconds) / repeats;
+      evaluation.seconds += (tuningSeconds + heldOutSeconds) / repeats;
+      evaluation.bytes = max(evaluation.bytes, model->bytes());
+    }
+    return evaluation;
+  }
+
+  // Freezes the tables after an update, adding the scores of the n new points, written by score(model, scores),
+  // to the sketches the threshold is read from
+  template <typename Score>
+  void freezeUpdate(ll n, Score score) {
+    auto model = make_shared<FrozenLSHADModel<Real>>(*hasher, estPerHash, 0, probes);
+    vector<ld> scores(n);
+    score(*model, scores.data());
+    for (ld value : scores) {
+      sketchScore(value);
+    }
+    threshold = sketchedThreshold();
+    model->setThreshold(threshold);
+    publish(model);
+  }
+
+  // Freezes the trained tables, resetting the sketches to the scores of the stored points and the threshold to
+  // the anomaly ratio of them. The stored points make up the first group of a window
+  void freeze() {
+    auto model = make_shared<FrozenLSHADModel<Real>>(*hasher, estPerHash, 0, probes);
+    scoreSketch = sketchStoredScores(*hasher, *model);
+    windowSketches.clear();
+    if (window > 0) {
+      windowSketches.push_back(scoreSketch);
+      lastSketchCount = hasher->size();
+    }
+    threshold = scoreSketch.quantile(anomalyRatio);
+    model->setThreshold(threshold);
+    publish(model);
+  }
+
+  ld sketchedThreshold() const {
+    if (window == 0) {
+      return scoreSketch.quantile(anomalyRatio);
+    }
+    QuantileSketch merged(SKETCH_K);
+    for (const auto &sketch : windowSketches) {
+      merged.merge(sketch);
+    }
+    return merged.quantile(anomalyRatio);
+  }
+
 public:
+  using ScoringScratch = typename FrozenLSHADModel<Real>::ScoringScratch;
+
   LSHAD(): hasher(nullptr), threshold(0){}
   ~LSHAD(){
     delete hasher;
   }
 
-  ld hashGroupAndCount(const vector<vector<ld>> data, ll L, ll T, ld wCandidate) {
-    ld averageBucketSize;
+  void setThreads(ll threads) {
+    this->threads = threads;
+  }
+
+  // Tunes w on a reservoir sample of the training data, grown only while the estimate is close to the band edges
+  // This is the default, with a first sample of 10000 points grown to at most 2^18
+  void setSampledTuning(const SamplingOptions &options) {
+    sampledTuning = true;
+    samplingOptions = options;
+  }
+
+  // Tunes w on the whole training data instead, holding T * L projections of every point while tuning
+  void setFullTuning() {
+    sampledTuning = false;
+  }
+
+  // Keeps only the last window points on update, evicting the oldest ones, so that memory stays flat on an endless
+  // stream and the estimators and threshold follow recent data. Set before train; 0 keeps every point
+  void setWindow(ll window) {
+    this->window = window;
+  }
+
+  // Scores points by also probing the given number of buckets per table around their bucket, set before train
+  void setMultiProbe(ll probes) {
+    this->probes = probes;
+  }
+
+  // Density of the random projections of the models trained from now on, below 1 for very sparse projections
+  // (see ProjectionMatrix); 0 picks dense projections for dense points and a density of 1 / sqrt(dim) for sparse ones
+  void setProjectionDensity(ld density) {
+    projectionDensity = density;
+  }
+
+  // Seed of the projections and tuning samples of the models trained from now on: the same seed and data give the
+  // same model on any machine, and its projection matrix can be left out of saved models. 0 draws a random seed
+  void setSeed(uint64_t seed) {
+    this->seed = seed;
+  }
+
+  // Number of tables of the models trained from now on
+  void setTables(ll T) {
+    tableCount = T;
+  }
+
+  // Number of hash values per table of the models trained from now on
+  void setHashLength(ll L) {
+    hashLength = L;
+  }
+
+  // Picks the fewest tables that, probing probes buckets per table, detect the anomalies of a labeled validation set
+  // as well as a single-probe model with the current number of tables does. Candidates are tried from 90% of the
+  // tables down in steps of 10%, until the F1 score of their flags against the labels falls more than tolerance below
+  // that of the reference. The smallest passing candidate is kept for train, the reference itself if none passes
+  // The F1 score of a model varies with its projections, so every model is scored as the mean over repeats projection
+  // seeds. Candidates are chosen on one half of the validation set, split evenly among anomalies and normal points,
+  // and the chosen one must also pass on the other, held-out half, or the next larger passing candidate is kept
+  TableTuningReport tuneTables(const vector<vector<Real>> &data, const vector<vector<Real>> &validation,
+                               const vector<bool> &anomalous, ld anomalyRatio, ll probes, ld tolerance = 0.02,
+                               ll repeats = 5) {
+    tuple<ll, ll, Real> hyperparameters = tuneHyperparameters(data);
+    ll L = get<0>(hyperparameters);
+    Real w = get<2>(hyperparameters);
+
+    ValidationSplit split = splitValidation(validation, anomalous);
+    auto evaluate = [&](ll T, ll candidateProbes) {
+      ModelEvaluation evaluation = evaluateModels(data, L, T, w, candidateProbes, anomalyRatio, split, repeats);
+      return TableCandidate{T, candidateProbes, evaluation.f1, evaluation.heldOutF1, evaluation.bytes,
+                            evaluation.seconds};
+    };
+
+    TableTuningReport report{tableCount, 0, {}};
+    report.candidates.push_back(evaluate(tableCount, 0));
+    const TableCandidate reference = report.candidates[0];
+
+    for (ll k = 9; k >= 1; --k) {
+      ll T = max(1LL, tableCount * k / 10);
+      if (T == report.candidates.back().T) {
+        continue;
+      }
+      report.candidates.push_back(evaluate(T, probes));
+      if (report.candidates.back().f1 < reference.f1 - tolerance) {
+        break;
+      }
+    }
 
-    HashTables *tempHasher = new HashTables(L, T, wCandidate, data[0].size());
-    for (const auto& vec: data) {
-        tempHasher->insert(vec);
+    // The passing candidates are those before the first miss; the smallest of them that also holds out is kept
+    ll passing = (ll) report.candidates.size();
+    if (passing > 1 && report.candidates.back().f1 < reference.f1 - tolerance) {
+      passing--;
     }
+    for (ll c = passing - 1; c >= 1; --c) {
+      if (report.candidates[c].heldOutF1 >= reference.heldOutF1 - tolerance) {
+        report.T = report.candidates[c].T;
+        report.probes = probes;
+        break;
+      }
+    }
+
+    tableCount = report.T;
+    this->probes = report.probes;
+    return report;
+  }
+
+  // Records the wall time of every score_batch call from now on, for the latency percentiles of getStats
+  // Off by default, as the calls then share a lock
+  void setLatencyTracking(bool enabled) {
+    lock_guard<mutex> lock(latencyMutex);
+    latencyTracking = enabled;
+    latencySketch = QuantileSketch(SKETCH_K);
+    maxLatency = 0;
+  }
+
+  // Phase timings of the last train, bucket sizes and memory of the trained model, and scoring latency if tracked
+  // Walks every bucket of every table, so it is not meant for a hot path
+  LSHADStats getStats() const {
+    LSHADStats stats = trainingStats;
+    stats.threshold = threshold;
+    if (hasher != nullptr) {
+      stats.points = hasher->size();
+      stats.L = hasher->getL();
+      stats.T = hasher->getT();
+      stats.w = hasher->getProjections().width();
+      for (ll t = 0; t < stats.T; ++t) {
+        stats.tables.push_back(hasher->bucketStats(t));
+        stats.maxBucketSize = max(stats.maxBucketSize, stats.tables.back().maxBucketSize);
+      }
+      stats.tableBytes = hasher->tableBytes();
+      stats.pointBytes = hasher->pointBytes();
+      for (const auto &table : estPerHash) {
+        stats.estimatorBytes += table.capacity() * sizeof(float);
+      }
+    }
+    if (auto model = getFrozenModel()) {
+      stats.modelBytes = model->bytes();
+    }
+
+    lock_guard<mutex> lock(latencyMutex);
+    stats.scoring.calls = latencySketch.size();
+    if (stats.scoring.calls > 0) {
+      stats.scoring.p50 = latencySketch.quantile(0.5);
+      stats.scoring.p90 = latencySketch.quantile(0.9);
+      stats.scoring.p99 = latencySketch.quantile(0.99);
+      stats.scoring.max = maxLatency;
+    }
+    return stats;
+  }
+
+  // Estimator of every bucket of the trained tables, by table and bucket ID
+  const BucketEstimators &getEstimators() const {
+    return estPerHash;
+  }
+
+  // Immutable model produced at the end of train, safe to share between scoring threads
+  // Loaded atomically, as update publishes a new model while other threads may be reading it
+  shared_ptr<const FrozenLSHADModel<Real>> getFrozenModel() const {
+    return atomic_load(&frozen);
+  }
+
+  // Saves the trained model in the binary model format, which FrozenLSHADModel::load maps back
+  // Without the projections, the projection matrix of a seeded model is generated again when loading (see setSeed)
+  bool saveModel(const string &path, bool withProjections = true) const {
+    auto model = getFrozenModel();
+    return model != nullptr && model->save(path, withProjections);
+  }
+
+  const TuningReport &getTuningReport() const {
+    return tuningReport;
+  }
+
+  ld hashGroupAndCount(const vector<vector<Real>> &data, ll L, ll T, Real wCandidate) {
+    ld averageBucketSize;
+
+    HashTables<Real> *tempHasher = new HashTables<Real>(L, T, wCandidate, data[0].size(), 1, seed);
+    tempHasher->setThreads(threads);
+    tempHasher->insertBatch(data);
 
     pair<ll, ll> p = tempHasher->getNumberBucketsAndSumBucketSizes();
     ll BC = p.first;
@@ -35,115 +489,390 @@ public:
     return averageBucketSize;
   }
 
-  tuple<ll, ll, ld> tuneHyperparameters(const vector<vector<ld>> data){
-    ll L = 4;
-    ll T = 50;
+  tuple<ll, ll, Real> tuneHyperparameters(const vector<vector<Real>> &data){
+    ll L = hashLength;
+    ll T = tableCount;
 
-    ld wCandidate = 1;
-    ld avBucketSize = 0;
-    ll leftLimit = 1;
-    ll rightLimit = 1;
+    tuningReport = tuneWidth(data, L, T);
 
-    while (avBucketSize < 0.05) {
-        avBucketSize = hashGroupAndCount(data, L, T, wCandidate);
-        wCandidate *= 2;
-    }
-    
+    return make_tuple(L, T, (Real) tuningReport.w);
+  }
 
-    rightLimit = wCandidate;
-    while (avBucketSize < 0.05 || avBucketSize > 0.1) {
-        wCandidate = floor((leftLimit + rightLimit) / 2);
-        avBucketSize = hashGroupAndCount(data, L, T, wCandidate);
+  // Tunes L, T and w together: w is tuned for the bucket occupancy target for every L of the budget, then models of
+  // each T are trained and their size, scoring time and F1 score on a labeled validation set measured, averaged over
+  // repeats projection seeds as in tuneTables
+  // The most accurate shape within the budget on one half of the validation set is kept for train (the smallest on
+  // ties), provided its F1 score on the held-out half is within tolerance of the best there, else the next one in
+  // that order; the smallest shape if none fits the budget. The report lists every candidate and the Pareto set among
+  // them. An empty grid of shapes leaves the shape as it is, with an empty report
+  ShapeTuningReport tuneShape(const vector<vector<Real>> &data, const vector<vector<Real>> &validation,
+                              const vector<bool> &anomalous, ld anomalyRatio, const TuningBudget &budget,
+                              ld tolerance = 0.02, ll repeats = 5) {
+    ShapeTuningReport report{hashLength, tableCount, 0, {}, {}};
+    if (budget.Ls.empty() || budget.Ts.empty()) {
+      return report;
+    }
+    ValidationSplit split = splitValidation(validation, anomalous);
+    for (ll L : budget.Ls) {
+      TuningReport width = tuneWidth(data, L, tableCount);
+      for (ll T : budget.Ts) {
+        ModelEvaluation evaluation = evaluateModels(data, L, T, (Real) width.w, probes, anomalyRatio, split, repeats);
+        double secondsPerPoint = evaluation.seconds / validation.size();
+        bool withinBudget = (budget.maxModelBytes == 0 || evaluation.bytes <= budget.maxModelBytes) &&
+                            (budget.maxSecondsPerPoint == 0 || secondsPerPoint <= budget.maxSecondsPerPoint);
+        report.candidates.push_back({L, T, width.w, width.averageBucketSize, evaluation.f1, evaluation.heldOutF1,
+                                     evaluation.bytes, secondsPerPoint, withinBudget});
+      }
+    }
 
-        if (avBucketSize < 0.05) {
-            leftLimit = wCandidate;
-        }
-        else if (avBucketSize > 0.1) {
-            rightLimit = wCandidate;
-        }
+    auto dominates = [](const ShapeCandidate &a, const ShapeCandidate &b) {
+      return a.f1 >= b.f1 && a.bytes <= b.bytes && a.secondsPerPoint <= b.secondsPerPoint &&
+             (a.f1 > b.f1 || a.bytes < b.bytes || a.secondsPerPoint < b.secondsPerPoint);
+    };
+    for (const auto &candidate : report.candidates) {
+      if (none_of(report.candidates.begin(), report.candidates.end(),
+                  [&](const ShapeCandidate &other) { return dominates(other, candidate); })) {
+        report.pareto.push_back(candidate);
+      }
+    }
 
-        if (leftLimit >= rightLimit) {
-            break;
+    // Within the budget first, then the most accurate and smallest; out of the budget, the smallest
+    auto better = [](const ShapeCandidate &a, const ShapeCandidate &b) {
+      if (a.withinBudget != b.withinBudget) {
+        return a.withinBudget;
+      }
+      if (a.withinBudget && a.f1 != b.f1) {
+        return a.f1 > b.f1;
+      }
+      return a.bytes < b.bytes;
+    };
+    vector<const ShapeCandidate *> ranked;
+    for (const auto &candidate : report.candidates) {
+      ranked.push_back(&candidate);
+    }
+    stable_sort(ranked.begin(), ranked.end(), [&](const ShapeCandidate *a, const ShapeCandidate *b) {
+      return better(*a, *b);
+    });
+    const ShapeCandidate *best = ranked[0];
+    if (best->withinBudget) {
+      ld heldOutBest = 0;
+      for (const auto &candidate : report.candidates) {
+        if (candidate.withinBudget) {
+          heldOutBest = max(heldOutBest, candidate.heldOutF1);
         }
+      }
+      best = *find_if(ranked.begin(), ranked.end(), [&](const ShapeCandidate *candidate) {
+        return candidate->heldOutF1 >= heldOutBest - tolerance;
+      });
     }
+    report.L = best->L;
+    report.T = best->T;
+    report.w = best->w;
 
-    return make_tuple(L, T, wCandidate);
+    hashLength = report.L;
+    tableCount = report.T;
+    return report;
   }
 
   void print_EstPerHash(){
-    for (const auto& est : estPerHash) {
-      cout << "Hash: ";
-      for (ll i : est.first) {
-        cout << i << " ";
+    for (ll t = 0; t < (ll) estPerHash.size(); ++t) {
+      const HashTable &table = hasher->getTables()[t];
+      for (uint32_t bucket = 0; bucket < (uint32_t) estPerHash[t].size(); ++bucket) {
+        cout << "Table: " << t << " Hash: ";
+        for (ll l = 0; l < table.keyLength(); ++l) {
+          cout << table.key(bucket)[l] << " ";
+        }
+        cout << "Estimator: " << estPerHash[t][bucket] << endl;
       }
-      cout << "Estimator: " << est.second << endl;
     }
   }
 
   // Training phase of the LSHAD algorithm
-  void train(const vector<vector<ld>> data, ld anomalyRatio){
-    tuple<ll, ll, ld> hyperparameters = tuneHyperparameters(data);
+  void train(const vector<vector<Real>> &data, ld anomalyRatio){
+    trainingStats = {};
+    Stopwatch watch;
+    tuple<ll, ll, Real> hyperparameters = tuneHyperparameters(data);
     ll L = get<0>(hyperparameters);
     ll T = get<1>(hyperparameters);
-    ld w = get<2>(hyperparameters);
-    cout << "L: " << L << " T: " << T << " w: " << w << endl;
+    Real w = get<2>(hyperparameters);
+    trainingStats.tuningSeconds = watch.lap();
 
     // Hasher of L * T hyperplanes generated for hashing the data points
-    hasher = new HashTables(L, T, w, data[0].size());
+    delete hasher;
+    hasher = new HashTables<Real>(L, T, w, data[0].size(), densityFor(data[0].size(), false), seed);
+    hasher->setThreads(threads);
     
     // Hashing the data points and computing the dictionary with the estimators per hash
-    estPerHash = hasher->HashAndEstimatePerHash(data);
-    cout << "Hasher size: " << hasher->getTables().size() << endl;
+    hasher->insertBatch(data);
+    trainingStats.hashingSeconds = watch.lap();
+    estPerHash = hasher->estimatePerHash();
+    trainingStats.estimationSeconds = watch.lap();
     // hasher->print();
     // print_EstPerHash();
 
     // Computing the threshold for the anomaly detection using the estimators calculated
-    threshold = findThreshold(estPerHash, anomalyRatio);
-    
-    cout << "Threshold: " << threshold << endl;
+    this->anomalyRatio = anomalyRatio;
+    freeze();
+    sinceEstimation = 0;
+    trainingStats.thresholdingSeconds = watch.lap();
   }
 
-  ld findThreshold(unordered_map<InnerHash, ld, InnerMapHash, InnerMapEqual> estPerHash, ll anomalyRatio){
-    
-    vector<ld> estimators;
-    // Get all the estimators from the hash tables in a list
-    
-    for (auto point: this->hasher->getHashesPerPoints()){
-      ld sum = 0;
-      for(auto hash: point){
-        sum += estPerHash[hash];
+  // Training phase reading the data from a source in chunks of chunkRows points, without holding it as nested vectors
+  // w is tuned on a reservoir sample of the source (see setSampledTuning), then the source is read once more to hash it
+  // Returns false, keeping the model trained before, if the source is empty or malformed
+  bool train(DataSource<Real> &source, ld anomalyRatio, ll chunkRows = 65536){
+    ll L = hashLength;
+    ll T = tableCount;
+    vector<Real> rows;
+    source.rewind();
+    if (source.next(rows, 1) == 0 || source.dim() <= 0) {
+      return false;
+    }
+    LSHADStats stats{};
+    Stopwatch watch;
+    TuningReport report = HyperparameterTuner<Real>::tuneSampled(source, L, T, threads, seededSampling());
+    if (source.failed()) {
+      return false;
+    }
+    Real w = (Real) report.w;
+    stats.tuningSeconds = watch.lap();
+
+    auto tables = make_unique<HashTables<Real>>(L, T, w, source.dim(), densityFor(source.dim(), false), seed);
+    tables->setThreads(threads);
+    source.rewind();
+    for (ll count = source.next(rows, chunkRows); count > 0; count = source.next(rows, chunkRows)) {
+      tables->insertBatch(rows.data(), count);
+    }
+    if (source.failed()) {
+      return false;
+    }
+    // Includes reading the source
+    stats.hashingSeconds = watch.lap();
+
+    delete hasher;
+    hasher = tables.release();
+    tuningReport = report;
+    estPerHash = hasher->estimatePerHash();
+    stats.estimationSeconds = watch.lap();
+
+    this->anomalyRatio = anomalyRatio;
+    freeze();
+    sinceEstimation = 0;
+    stats.thresholdingSeconds = watch.lap();
+    trainingStats = stats;
+    return true;
+  }
+
+  // Training phase on sparse points, which are never densified: hashing a point costs O(nnz * T * L) with dense
+  // projections, and less with very sparse ones
+  void train(const SparseRows<Real> &data, ld anomalyRatio) {
+    ll L = hashLength;
+    ll T = tableCount;
+    ld density = densityFor(data.dim(), true);
+    trainingStats = {};
+    Stopwatch watch;
+    HyperparameterTuner<Real> tuner(data, L, T, density, threads, 0, seed);
+    tuningReport = tuner.tune();
+    Real w = (Real) tuningReport.w;
+    trainingStats.tuningSeconds = watch.lap();
+
+    delete hasher;
+    hasher = new HashTables<Real>(L, T, w, data.dim(), density, seed);
+    hasher->setThreads(threads);
+    hasher->insertBatch(data);
+    trainingStats.hashingSeconds = watch.lap();
+    estPerHash = hasher->estimatePerHash();
+    trainingStats.estimationSeconds = watch.lap();
+
+    this->anomalyRatio = anomalyRatio;
+    freeze();
+    sinceEstimation = 0;
+    trainingStats.thresholdingSeconds = watch.lap();
+  }
+
+  // Sharded training, for data that does not fit one process: every worker summarizes its own disjoint slice of the
+  // data with summarizeShard, and a reducer builds the model of the whole data from the summaries with mergeShards
+  // Workers must share the seed (see setSeed), the shape and w, which is tuned once, e.g. by tuneHyperparameters on a
+  // sample of the data, and handed to all of them
+  ShardSummary<Real> summarizeShard(const vector<vector<Real>> &data, Real w) const {
+    ll dim = data[0].size();
+    HashTables<Real> tables(hashLength, tableCount, w, dim, densityFor(dim, false), seed);
+    tables.setThreads(threads);
+    BucketEstimators estimators = tables.HashAndEstimatePerHash(data);
+    FrozenLSHADModel<Real> model(tables, estimators, 0, probes);
+    return ShardSummary<Real>(tables, sketchStoredScores(tables, model));
+  }
+
+  // Builds the model of the data of all the shards from their summaries, with the threshold at the given ratio of the
+  // scores of their points. Returns false if the shards were not hashed by the same seeded projections
+  // The neighbor counts of a shard only count its own points, so they are scaled by (n - 1) / (n_s - 1) for n points
+  // in all and n_s in the shard, which assumes every slice is a random sample of the data. The threshold is read from
+  // the merged score sketches of the shards, each scored by its own model: EA / EB does not change when a random
+  // sample grows to the whole data. A single shard gives exactly the model of train with the same w
+  // The merged model holds no points, so it scores but cannot be updated (update returns false)
+  bool mergeShards(const vector<ShardSummary<Real>> &shards, ld anomalyRatio) {
+    if (shards.empty() || shards[0].seed == 0) {
+      return false;
+    }
+    const ShardSummary<Real> &first = shards[0];
+    ll n = 0;
+    for (const auto &shard : shards) {
+      if (!shard.compatible(first)) {
+        return false;
       }
-      estimators.push_back(sum);
+      n += shard.points;
     }
-    sort(estimators.begin(), estimators.end());
-    
-    // Get the estimator that corresponds to the anomaly ratio
-    ld index = static_cast<size_t>(estimators.size()) * anomalyRatio;
-    
-    if (index > estimators.size() - 1) {
-      index = estimators.size() - 1;
+    trainingStats = {};
+    Stopwatch watch;
+
+    // Sizes and neighbor sums of the buckets of all the shards, by bucket ID of the merged tables
+    HashTables<Real> tables(first.L, first.T, first.w, first.dim, first.density, first.seed);
+    vector<vector<ll>> sizes(first.T);
+    vector<vector<ld>> neighbors(first.T);
+    QuantileSketch sketch(SKETCH_K);
+    for (const auto &shard : shards) {
+      ld scale = (ld) (n - 1) / max(1LL, shard.points - 1);
+      for (ll t = 0; t < first.T; ++t) {
+        const auto &table = shard.tables[t];
+        for (size_t b = 0; b < table.sizes.size(); ++b) {
+          uint32_t bucket = tables.addBucket(t, table.keys.data() + b * first.L);
+          if (bucket >= sizes[t].size()) {
+            sizes[t].resize(bucket + 1, 0);
+            neighbors[t].resize(bucket + 1, 0);
+          }
+          sizes[t][bucket] += table.sizes[b];
+          neighbors[t][bucket] += table.neighbors[b] * scale;
+        }
+      }
+      sketch.merge(shard.scores);
+    }
+
+    estPerHash.assign(first.T, {});
+    for (ll t = 0; t < first.T; ++t) {
+      estPerHash[t].resize(sizes[t].size());
+      for (size_t bucket = 0; bucket < sizes[t].size(); ++bucket) {
+        estPerHash[t][bucket] = HashTables<Real>::estimator(sizes[t][bucket], neighbors[t][bucket]);
+      }
     }
-    return estimators[index];
+    trainingStats.estimationSeconds = watch.lap();
+
+    delete hasher;
+    hasher = nullptr;
+    this->anomalyRatio = anomalyRatio;
+    scoreSketch = sketch;
+    windowSketches.clear();
+    threshold = scoreSketch.quantile(anomalyRatio);
+    publish(make_shared<const FrozenLSHADModel<Real>>(tables, estPerHash, threshold, probes));
+    trainingStats.thresholdingSeconds = watch.lap();
+    return true;
+  }
+
+  // Score below which the given ratio of the stored points falls, read from a sketch of their scores
+  // The sketch is exact below SKETCH_K points and has a rank error of about 0.1% of the points beyond that
+  ld findThreshold(const BucketEstimators &estPerHash, ld anomalyRatio) const {
+    FrozenLSHADModel<Real> model(*hasher, estPerHash, 0, probes);
+    return sketchStoredScores(*hasher, model).quantile(anomalyRatio);
+  }
+
+  // Sketch of the scores of the points seen by train and, without a window, update; mergeable with those of other models
+  const QuantileSketch &getScoreSketch() const {
+    return scoreSketch;
   }
   
-  bool detection_phase(const vector<ld> point) {
-    // auto hashes = hasher->getHashes(point);  TODO: Implement getHashes
-    vector<InnerHash> hashes = hasher->search_tables(point);
-    cout << "hashes.size(): " << hashes.size() << endl;
-    ld estimator = 0;
+  // Online update: inserts n row-major points into the trained tables without retraining
+  // Only the estimators of the buckets the new points fall in are recomputed (see HashTables::updateEstimators), and
+  // the threshold is read from a quantile sketch of the scores instead of sorting all of them again. Scores already in
+  // the sketch are not revised, so a full train is still due once the data has drifted far from the training set
+  // Scoring threads holding the previous frozen model keep using it, the next getFrozenModel returns the updated one
+  // With a window (see setWindow) the oldest points are evicted as new ones come in
+  // An update is not cheap whatever n: the frozen model is serialized again whole, O(model size), however few buckets
+  // changed, and recomputing an estimator recounts the neighbors of every point of its bucket, a few percent of the
+  // points at the bucket occupancy target. With a window, every estimator is recomputed once per window turnover.
+  // Batch points into fewer, larger updates rather than updating point by point
+  // Returns false, inserting nothing, before training, on a model trained on sparse points or on a model merged from
+  // shards, which holds no points
+  bool update(const Real *rows, ll n) {
+    if (hasher == nullptr || hasher->isSparse()) {
+      return false;
+    }
+    if (window > 0) {
+      hasher->insertWindowed(rows, n, window, estPerHash);
+      // Once per window turnover, every estimator is recomputed so none stays stale for longer than a window
+      sinceEstimation += n;
+      if (sinceEstimation >= window) {
+        estPerHash = hasher->estimatePerHash();
+        sinceEstimation = 0;
+      }
+    } else {
+      uint32_t first = (uint32_t) hasher->size();
+      hasher->insertBatch(rows, n);
+      hasher->updateEstimators(first, estPerHash);
+    }
+
+    freezeUpdate(n, [&](const FrozenLSHADModel<Real> &model, ld *scores) {
+      model.score_batch(rows, n, hasher->getDim(), scores, nullptr);
+    });
+    return true;
+  }
 
-    for (const auto& hash: hashes) {
-      // cout << "-> " << estPerHash[hash] << endl;
-      estimator += estPerHash[hash];
+  // Online update with sparse points, into a model trained on sparse points and without a window
+  // Returns false, inserting nothing, on any other model or if the points are not of the dimension of the model
+  bool update(const SparseRows<Real> &rows) {
+    if (hasher == nullptr || window > 0 || !hasher->isSparse() || rows.dim() != hasher->getDim()) {
+      return false;
     }
+    uint32_t first = (uint32_t) hasher->size();
+    hasher->insertBatch(rows);
+    hasher->updateEstimators(first, estPerHash);
 
-    cout << "Point: ";
-    for(auto i: point){
-      cout << i << " ";
+    freezeUpdate(rows.size(), [&](const FrozenLSHADModel<Real> &model, ld *scores) {
+      model.score_batch(rows, 0, rows.size(), scores, nullptr);
+    });
+    return true;
+  }
+
+  // Also returns false if a point is not of the dimension of the model
+  bool update(const vector<vector<Real>> &data) {
+    if (hasher == nullptr) {
+      return false;
     }
-    cout << "Estimator: " << estimator << endl;
+    vector<Real> rows;
+    rows.reserve(data.size() * hasher->getDim());
+    for (const auto &point : data) {
+      if ((ll) point.size() != hasher->getDim()) {
+        return false;
+      }
+      rows.insert(rows.end(), point.begin(), point.end());
+    }
+    return update(rows.data(), (ll) data.size());
+  }
 
-    return estimator <= threshold;
+  // Scores n row-major points of dimension dim, writing the summed estimator of each point to out_scores
+  // and whether it is an anomaly to out_flags (either may be null)
+  // Scoring goes through the frozen model, so it can be called from many threads at once
+  // Returns false, scoring nothing, before training or if dim is not the dimension of the model
+  bool score_batch(const Real *rows, size_t n, size_t dim, ld *out_scores, bool *out_flags, ScoringScratch &scratch) const {
+    return timedScoring([&](const FrozenLSHADModel<Real> &model) { return model.score_batch(rows, n, dim, out_scores, out_flags, scratch); });
   }
-};
 
+  bool score_batch(const Real *rows, size_t n, size_t dim, ld *out_scores, bool *out_flags) const {
+    return timedScoring([&](const FrozenLSHADModel<Real> &model) { return model.score_batch(rows, n, dim, out_scores, out_flags); });
+  }
+
+  // Same for n sparse points of rows from point first
+  bool score_batch(const SparseRows<Real> &rows, ll first, ll n, ld *out_scores, bool *out_flags,
+                   ScoringScratch &scratch) const {
+    return timedScoring([&](const FrozenLSHADModel<Real> &model) { return model.score_batch(rows, first, n, out_scores, out_flags, scratch); });
+  }
+
+  bool score_batch(const SparseRows<Real> &rows, ll first, ll n, ld *out_scores, bool *out_flags) const {
+    return timedScoring([&](const FrozenLSHADModel<Real> &model) { return model.score_batch(rows, first, n, out_scores, out_flags); });
+  }
+
+  // Whether the point is an anomaly; false too for a point of another dimension than the model's
+  bool detection_phase(const vector<Real> &point) {
+    ld estimator;
+    bool anomaly;
+    return score_batch(point.data(), 1, point.size(), &estimator, &anomaly) && anomaly;
+  }
+};
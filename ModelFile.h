@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "hashes.h"
+
+using namespace std;
+
+// Binary model format
+// Every section starts at a multiple of MODEL_ALIGNMENT and holds the in-memory representation of its arrays
+// (little-endian on the platforms we build for), so a mapped file is queried in place:
+//   ModelHeader
+//   ModelTableEntry[T]                     one per table
+//   float estimators[estimatorCount]       those of the buckets of each table, one table after the other
+//   per table: FlatSlot slots[slotCount], ll keys[entryCount * L]
+//   Real betas[T * L], alphas[T * L * dim] projection matrix, with no alphas if it is sparse
+//   uint64_t columnOffsets[dim + 1], uint32_t columnRows[nnz], Real columnValues[nnz]  sparse projection matrix only
+// The projection matrix comes last so that a model of a seeded matrix can be saved without it (regenerateProjections),
+// the file then ending at projectionsOffset and the matrix being generated again from the seed when loading
+// Version 2 added the number of buckets probed per table next to the bucket of a point, version 3 sparse projections,
+// version 4 the seed of the projections, version 5 one estimator per bucket of each table instead of one per
+// distinct hash value, the estimator of bucket b of a table being estimators[firstEstimator + b]
+constexpr char MODEL_MAGIC[8] = {'L', 'S', 'H', 'A', 'D', 'M', 'D', 'L'};
+constexpr uint32_t MODEL_VERSION = 5;
+
+// Bounds on the shape read from a model or shard file, which keep the products of L, T and dim from overflowing
+constexpr ll MAX_FILE_L = 64;
+constexpr ll MAX_FILE_T = 1LL << 24;
+constexpr ll MAX_FILE_DIM = 1LL << 32;
+
+inline bool validFileShape(ll L, ll T, ll dim) {
+  return L >= 1 && L <= MAX_FILE_L && T >= 1 && T <= MAX_FILE_T && dim >= 1 && dim <= MAX_FILE_DIM;
+}
+
+// Most entries of a projection matrix generated from the seed and shape of a file (see ProjectionMatrix), about the
+// alphas of a dense matrix of 2^30 coordinates, so that a corrupt file cannot ask for an unbounded allocation
+constexpr uint64_t MAX_GENERATED_PROJECTION_ENTRIES = 1ULL << 30;
+
+// Entries generated for T * L rows of dim coordinates at the given density: the dense alphas, or the column offsets
+// and expected non-zero entries of a sparse matrix
+inline bool generatedProjectionFits(ll L, ll T, ll dim, ld density) {
+  ld rows = (ld) T * L;
+  ld entries = density < 1 ? (ld) dim + 1 + rows * dim * density : rows * dim;
+  return entries <= (ld) MAX_GENERATED_PROJECTION_ENTRIES;
+}
+constexpr uint64_t MODEL_ALIGNMENT = 64;
+
+struct ModelHeader {
+  char magic[8];
+  uint32_t version;
+  // Sizes of the coordinate type, the estimator type and a hash table slot, checked when loading
+  uint32_t realSize;
+  uint32_t estimatorSize;
+  uint32_t slotSize;
+  int64_t L, T, dim, probes;
+  uint64_t estimatorCount;
+  long double w;
+  long double threshold;
+  uint64_t tablesOffset, alphasOffset, betasOffset, estimatorsOffset;
+  // Non-zero entries of a sparse projection matrix, and where its columns are; all 0 for a dense matrix
+  uint64_t sparseProjection, projectionNonZeros;
+  uint64_t columnOffsetsOffset, columnRowsOffset, columnValuesOffset;
+  // Seed and density the projection matrix was generated from, the seed 0 if it cannot be generated again
+  uint64_t seed;
+  long double density;
+  // Where the projection matrix starts, and whether it is left out of the file and generated from the seed
+  uint64_t projectionsOffset, regenerateProjections;
+  uint64_t fileSize;
+};
+
+struct ModelTableEntry {
+  uint64_t slotsOffset, slotCount;
+  uint64_t keysOffset, entryCount;
+  uint64_t firstEstimator;
+};
+
+inline uint64_t alignModelOffset(uint64_t offset) {
+  return (offset + MODEL_ALIGNMENT - 1) / MODEL_ALIGNMENT * MODEL_ALIGNMENT;
+}
+
+// Memory holding a serialized model: an aligned heap buffer or a read-only mapping of a model (or data) file
+class ModelBuffer {
+private:
+  shared_ptr<char> bytes;
+  size_t length = 0;
+
+public:
+  ModelBuffer() = default;
+
+  // Allocates a zeroed buffer of the given size
+  explicit ModelBuffer(size_t size) : length(size) {
+    char *memory = static_cast<char *>(::operator new(size, align_val_t(MODEL_ALIGNMENT)));
+    memset(memory, 0, size);
+    bytes = shared_ptr<char>(memory, [](char *p) { ::operator delete(p, align_val_t(MODEL_ALIGNMENT)); });
+  }
+
+  // Maps a model file read-only, returning an empty buffer if it cannot be mapped
+  static ModelBuffer map(const string &path) {
+    ModelBuffer buffer;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return buffer;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+      close(fd);
+      return buffer;
+    }
+    void *memory = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+      return buffer;
+    }
+
+    size_t size = st.st_size;
+    buffer.length = size;
+    buffer.bytes = shared_ptr<char>(static_cast<char *>(memory), [size](char *p) { munmap(p, size); });
+    return buffer;
+  }
+
+  char *data() const {
+    return bytes.get();
+  }
+
+  size_t size() const {
+    return length;
+  }
+
+  bool empty() const {
+    return bytes == nullptr;
+  }
+};
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include "hashes.h"
+
+using namespace std;
+
+// Resolves a requested number of threads, 0 meaning one per hardware thread
+inline ll resolveThreads(ll threads) {
+  if (threads > 0) {
+    return threads;
+  }
+  ll hardware = (ll) thread::hardware_concurrency();
+  return hardware > 0 ? hardware : 1;
+}
+
+// Runs fn(begin, end, worker) over [0, n) split into chunks of grain indices
+// Workers claim the next chunk from a shared counter as soon as they finish one, so uneven chunks balance out
+// worker is in [0, threads) and can be used to index per-worker scratch buffers
+template <typename Fn>
+void parallelFor(ll n, ll threads, ll grain, Fn fn) {
+  ll workers = min(resolveThreads(threads), (n + grain - 1) / grain);
+  if (workers <= 1) {
+    if (n > 0) {
+      fn(0, n, 0);
+    }
+    return;
+  }
+
+  atomic<ll> next(0);
+  auto work = [&](ll worker) {
+    for (ll begin = next.fetch_add(grain); begin < n; begin = next.fetch_add(grain)) {
+      fn(begin, min(n, begin + grain), worker);
+    }
+  };
+
+  vector<thread> pool;
+  for (ll worker = 1; worker < workers; ++worker) {
+    pool.emplace_back(work, worker);
+  }
+  work(0);
+  for (auto &th : pool) {
+    th.join();
+  }
+}
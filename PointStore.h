@@ -0,0 +1,62 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include "hashes.h"
+
+using namespace std;
+
+// Stores every inserted point once, in a single contiguous row-major buffer
+// Points are addressed by the 32-bit ID assigned to them when added
+template <typename Real = ld>
+class PointStore {
+private:
+  vector<Real> coords;
+  ll DIM;
+
+public:
+  explicit PointStore(ll dim) : DIM(dim) {}
+
+  void reserve(ll n) {
+    coords.reserve(n * DIM);
+  }
+
+  // Appends a point to the store and returns its ID
+  uint32_t add(const Real *x) {
+    uint32_t id = (uint32_t) size();
+    coords.insert(coords.end(), x, x + DIM);
+    return id;
+  }
+
+  uint32_t add(const vector<Real> &x) {
+    return add(x.data());
+  }
+
+  // Overwrites the coordinates of the point with the given ID
+  void set(uint32_t id, const Real *x) {
+    copy(x, x + DIM, coords.begin() + (size_t) id * DIM);
+  }
+
+  // Pointer to the DIM coordinates of the point with the given ID
+  const Real *operator[](uint32_t id) const {
+    return coords.data() + (size_t) id * DIM;
+  }
+
+  vector<Real> get(uint32_t id) const {
+    const Real *row = (*this)[id];
+    return vector<Real>(row, row + DIM);
+  }
+
+  ll size() const {
+    return DIM > 0 ? (ll) (coords.size() / DIM) : 0;
+  }
+
+  ll dim() const {
+    return DIM;
+  }
+
+  size_t bytes() const {
+    return coords.capacity() * sizeof(Real);
+  }
+};
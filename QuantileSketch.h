@@ -0,0 +1,154 @@
+#pragma once
+
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <istream>
+#include <ostream>
+#include "hashes.h"
+
+using namespace std;
+
+// KLL quantile sketch (Karnin, Lang and Liberty): answers approximate quantiles of a stream in bounded memory
+// Items are kept in compactors of decreasing capacity; a full compactor sorts its items and promotes every other one
+// to the next level, where each item stands for twice as many. Two sketches can be merged level by level
+class QuantileSketch {
+private:
+  // Capacity of the top compactor, the rank error is about 1.7 / k
+  ll k;
+  vector<vector<ld>> compactors;
+  ll count = 0;
+  mt19937_64 coin;
+
+  ll capacity(ll level) const {
+    ll height = (ll) compactors.size();
+    return max(2LL, (ll) ceil(k * pow(2.0 / 3.0, (double) (height - 1 - level))));
+  }
+
+  void compress() {
+    for (ll level = 0; level < (ll) compactors.size(); ++level) {
+      if ((ll) compactors[level].size() < capacity(level)) {
+        continue;
+      }
+      if (level + 1 == (ll) compactors.size()) {
+        compactors.emplace_back();
+      }
+      vector<ld> &items = compactors[level];
+      sort(items.begin(), items.end());
+
+      // An odd item out stays at this level
+      ld leftover = 0;
+      bool odd = items.size() % 2 == 1;
+      if (odd) {
+        leftover = items.back();
+        items.pop_back();
+      }
+      for (size_t i = coin() & 1; i < items.size(); i += 2) {
+        compactors[level + 1].push_back(items[i]);
+      }
+      items.clear();
+      if (odd) {
+        items.push_back(leftover);
+      }
+    }
+  }
+
+public:
+  explicit QuantileSketch(ll k = 200, uint64_t seed = 1) : k(k), compactors(1), coin(seed) {}
+
+  void insert(ld value) {
+    compactors[0].push_back(value);
+    ++count;
+    if ((ll) compactors[0].size() >= capacity(0)) {
+      compress();
+    }
+  }
+
+  // Adds the items of another sketch, as if its stream had been inserted into this one
+  void merge(const QuantileSketch &other) {
+    while (compactors.size() < other.compactors.size()) {
+      compactors.emplace_back();
+    }
+    for (size_t level = 0; level < other.compactors.size(); ++level) {
+      compactors[level].insert(compactors[level].end(), other.compactors[level].begin(), other.compactors[level].end());
+    }
+    count += other.count;
+    compress();
+  }
+
+  // Writes the sketch in binary: k, the number of values inserted, then the items of every compactor
+  void write(ostream &out) const {
+    ll levels = (ll) compactors.size();
+    out.write(reinterpret_cast<const char *>(&k), sizeof(k));
+    out.write(reinterpret_cast<const char *>(&count), sizeof(count));
+    out.write(reinterpret_cast<const char *>(&levels), sizeof(levels));
+    for (const auto &compactor : compactors) {
+      ll items = (ll) compactor.size();
+      out.write(reinterpret_cast<const char *>(&items), sizeof(items));
+      out.write(reinterpret_cast<const char *>(compactor.data()), items * sizeof(ld));
+    }
+  }
+
+  // Reads a sketch written by write, returns false if the stream ends early or does not hold one
+  bool read(istream &in) {
+    ll levels = 0;
+    in.read(reinterpret_cast<char *>(&k), sizeof(k));
+    in.read(reinterpret_cast<char *>(&count), sizeof(count));
+    in.read(reinterpret_cast<char *>(&levels), sizeof(levels));
+    if (!in || k < 2 || k > (1 << 24) || levels < 1 || levels > 64) {
+      return false;
+    }
+    compactors.assign(levels, {});
+    for (auto &compactor : compactors) {
+      ll items = 0;
+      in.read(reinterpret_cast<char *>(&items), sizeof(items));
+      if (!in || items < 0 || items > 4 * k) {
+        return false;
+      }
+      compactor.resize(items);
+      in.read(reinterpret_cast<char *>(compactor.data()), items * sizeof(ld));
+    }
+    return (bool) in;
+  }
+
+  // Number of values inserted
+  ll size() const {
+    return count;
+  }
+
+  // Number of values held, bounded by about 3k
+  ll retained() const {
+    ll items = 0;
+    for (const auto &compactor : compactors) {
+      items += (ll) compactor.size();
+    }
+    return items;
+  }
+
+  // Smallest retained value whose estimated rank is at least q of the values inserted
+  ld quantile(ld q) const {
+    vector<pair<ld, ll>> weighted;
+    ll total = 0;
+    for (size_t level = 0; level < compactors.size(); ++level) {
+      for (ld value : compactors[level]) {
+        weighted.emplace_back(value, 1LL << level);
+        total += 1LL << level;
+      }
+    }
+    if (weighted.empty()) {
+      return 0;
+    }
+    sort(weighted.begin(), weighted.end());
+
+    ld target = q * (ld) total;
+    ll rank = 0;
+    for (const auto &item : weighted) {
+      rank += item.second;
+      if ((ld) rank > target) {
+        return item.first;
+      }
+    }
+    return weighted.back().first;
+  }
+};
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+#include <random>
+#include "hashes.h"
+
+using namespace std;
+
+// SplitMix64 finalizer, a bijective mix of the bits of x
+inline uint64_t mix64(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+// Seed drawn from the system when the given one is 0, so that 0 can mean "not reproducible"
+inline uint64_t resolveSeed(uint64_t seed) {
+  while (seed == 0) {
+    random_device rd;
+    seed = ((uint64_t) rd() << 32) ^ rd();
+  }
+  return seed;
+}
+
+// Counter-based random numbers: number k of stream s of a seed is a hash of (seed, s, k), so any stream, e.g. one
+// row of a projection matrix, is generated on its own, on any thread and in any order, and always the same
+// The uniform and Gaussian numbers are computed here rather than by <random> distributions, whose output differs
+// between standard libraries, so a seed gives the same numbers on every platform
+class CounterRng {
+private:
+  uint64_t key;
+  uint64_t counter = 0;
+
+public:
+  CounterRng(uint64_t seed, uint64_t stream) : key(mix64(seed ^ mix64(stream + 0x9e3779b97f4a7c15ULL))) {}
+
+  uint64_t next() {
+    return mix64(key + 0x9e3779b97f4a7c15ULL * ++counter);
+  }
+
+  // Uniform in [0, bound), rejecting the top draws that would make next() % bound favour small values
+  uint64_t below(uint64_t bound) {
+    uint64_t limit = UINT64_MAX - UINT64_MAX % bound;
+    uint64_t x = next();
+    while (x >= limit) {
+      x = next();
+    }
+    return x % bound;
+  }
+
+  // Uniform in [0, 1)
+  double uniform() {
+    return (double) (next() >> 11) * 0x1.0p-53;
+  }
+
+  // Standard normal, by the Box-Muller transform
+  double gaussian() {
+    double u = 1.0 - uniform();
+    double v = uniform();
+    return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+  }
+
+  // Number of failures before the first success of trials succeeding with probability p
+  ll geometric(double p) {
+    return (ll) floor(log(1.0 - uniform()) / log1p(-p));
+  }
+};
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <fstream>
+#include <cstring>
+#include "HashTables2.h"
+#include "ModelFile.h"
+#include "QuantileSketch.h"
+
+using namespace std;
+
+// Shard summary format, written by a worker of a sharded training (see LSHAD::summarizeShard)
+//   ShardHeader
+//   per table: int64_t buckets, ll keys[buckets * L], int64_t sizes[buckets], int64_t neighbors[buckets]
+//   QuantileSketch of the scores of the points of the shard (see QuantileSketch::write)
+constexpr char SHARD_MAGIC[8] = {'L', 'S', 'H', 'A', 'D', 'S', 'H', 'D'};
+constexpr uint32_t SHARD_VERSION = 1;
+
+struct ShardHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t realSize;
+  int64_t L, T, dim, points;
+  long double w, density;
+  uint64_t seed;
+};
+
+// Bucket statistics of the points of one shard of the training data, mergeable with those of the other shards
+// Sizes and sums of neighbor counts add up across shards once the neighbor counts, which only count the points of
+// the shard, are scaled to the whole data (see LSHAD::mergeShards)
+template <typename Real = ld>
+struct ShardSummary {
+  // Per table, the L hash values of every bucket, and their sizes and sums of the neighbor counts of their points
+  struct Table {
+    vector<ll> keys;
+    vector<ll> sizes;
+    vector<ll> neighbors;
+  };
+
+  ll L = 0, T = 0, dim = 0;
+  Real w = 0;
+  ld density = 1;
+  uint64_t seed = 0;
+  // Points of the shard
+  ll points = 0;
+
+  vector<Table> tables;
+  // Scores of the points of the shard under the model of the shard alone
+  QuantileSketch scores;
+
+  ShardSummary() = default;
+
+  // Summary of tables whose estimators were computed by estimatePerHash
+  ShardSummary(const HashTables<Real> &hasher, QuantileSketch scores)
+      : L(hasher.getL()), T(hasher.getT()), dim(hasher.getDim()), w(hasher.getProjections().width()),
+        density(hasher.getProjections().getDensity()), seed(hasher.getProjections().getSeed()), points(hasher.size()),
+        tables(T), scores(move(scores)) {
+    for (ll t = 0; t < T; ++t) {
+      const HashTable &table = hasher.getTables()[t];
+      for (uint32_t bucket = 0; bucket < (uint32_t) table.size(); ++bucket) {
+        tables[t].keys.insert(tables[t].keys.end(), table.key(bucket), table.key(bucket) + L);
+        tables[t].sizes.push_back(table.bucketSize(bucket));
+        tables[t].neighbors.push_back(hasher.bucketNeighbors(t, bucket));
+      }
+    }
+  }
+
+  // Whether the shards were hashed by the same projections, and so can be merged
+  bool compatible(const ShardSummary &other) const {
+    return L == other.L && T == other.T && dim == other.dim && w == other.w && density == other.density &&
+           seed == other.seed;
+  }
+
+  // Writes the summary in the shard summary format, returns false if the file cannot be written
+  bool save(const string &path) const {
+    ShardHeader header{};
+    memcpy(header.magic, SHARD_MAGIC, sizeof(SHARD_MAGIC));
+    header.version = SHARD_VERSION;
+    header.realSize = sizeof(Real);
+    header.L = L;
+    header.T = T;
+    header.dim = dim;
+    header.points = points;
+    header.w = w;
+    header.density = density;
+    header.seed = seed;
+
+    ofstream file(path, ios::binary | ios::trunc);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    for (const auto &table : tables) {
+      int64_t buckets = (int64_t) table.sizes.size();
+      file.write(reinterpret_cast<const char *>(&buckets), sizeof(buckets));
+      file.write(reinterpret_cast<const char *>(table.keys.data()), table.keys.size() * sizeof(ll));
+      file.write(reinterpret_cast<const char *>(table.sizes.data()), buckets * sizeof(ll));
+      file.write(reinterpret_cast<const char *>(table.neighbors.data()), buckets * sizeof(ll));
+    }
+    scores.write(file);
+    return (bool) file;
+  }
+
+  // Reads a summary written by save, returns false if the file cannot be read or is not a summary of this type
+  // The shape is bounded as that of a model file, and every table checked to fit in the rest of the file before it
+  // is read, so that a corrupt summary cannot ask for unbounded allocations here or in mergeShards
+  bool load(const string &path) {
+    ifstream file(path, ios::binary | ios::ate);
+    int64_t remaining = file ? (int64_t) file.tellg() : 0;
+    file.seekg(0);
+    ShardHeader header{};
+    file.read(reinterpret_cast<char *>(&header), sizeof(header));
+    remaining -= sizeof(header);
+    if (!file || memcmp(header.magic, SHARD_MAGIC, sizeof(SHARD_MAGIC)) != 0 || header.version != SHARD_VERSION ||
+        header.realSize != sizeof(Real) || !validFileShape(header.L, header.T, header.dim) || header.points < 0 ||
+        !(header.w > 0) || !(header.density > 0) ||
+        !generatedProjectionFits(header.L, header.T, header.dim, header.density) ||
+        header.T > remaining / (int64_t) sizeof(int64_t)) {
+      return false;
+    }
+    L = header.L;
+    T = header.T;
+    dim = header.dim;
+    points = header.points;
+    w = (Real) header.w;
+    density = header.density;
+    seed = header.seed;
+
+    tables.assign(T, {});
+    for (auto &table : tables) {
+      int64_t buckets = 0;
+      file.read(reinterpret_cast<char *>(&buckets), sizeof(buckets));
+      remaining -= sizeof(buckets);
+      if (!file || buckets < 0 || buckets > points || buckets > remaining / (int64_t) ((L + 2) * sizeof(ll))) {
+        return false;
+      }
+      remaining -= buckets * (L + 2) * sizeof(ll);
+      table.keys.resize(buckets * L);
+      table.sizes.resize(buckets);
+      table.neighbors.resize(buckets);
+      file.read(reinterpret_cast<char *>(table.keys.data()), table.keys.size() * sizeof(ll));
+      file.read(reinterpret_cast<char *>(table.sizes.data()), buckets * sizeof(ll));
+      file.read(reinterpret_cast<char *>(table.neighbors.data()), buckets * sizeof(ll));
+      if (!file || any_of(table.sizes.begin(), table.sizes.end(), [](ll size) { return size < 0; }) ||
+          any_of(table.neighbors.begin(), table.neighbors.end(), [](ll count) { return count < 0; })) {
+        return false;
+      }
+    }
+    return file && scores.read(file);
+  }
+};
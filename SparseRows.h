@@ -0,0 +1,99 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include "hashes.h"
+
+using namespace std;
+
+// Non-zero coordinates of one point of a SparseRows
+template <typename Real = ld>
+struct SparseRow {
+  const uint32_t *indices;
+  const Real *values;
+  ll nnz;
+};
+
+// Points of many dimensions with few non-zero coordinates, stored in compressed sparse row (CSR) form:
+// the (index, value) pairs of all the points one after the other, and where the pairs of each point start
+template <typename Real = ld>
+class SparseRows {
+private:
+  vector<uint64_t> offsets{0};
+  vector<uint32_t> indices;
+  vector<Real> values;
+  ll DIM;
+
+public:
+  explicit SparseRows(ll dim = 0) : DIM(dim) {}
+
+  void reserve(ll rows, ll nonZeros) {
+    offsets.reserve(rows + 1);
+    indices.reserve(nonZeros);
+    values.reserve(nonZeros);
+  }
+
+  // Appends a point given by its nnz non-zero coordinates, in any order
+  // Returns false, appending nothing, if an index is not below dim, so that every stored index is a valid coordinate
+  bool add(const uint32_t *index, const Real *value, ll nnz) {
+    if (any_of(index, index + nnz, [&](uint32_t i) { return i >= DIM; })) {
+      return false;
+    }
+    indices.insert(indices.end(), index, index + nnz);
+    values.insert(values.end(), value, value + nnz);
+    offsets.push_back(indices.size());
+    return true;
+  }
+
+  bool add(const vector<pair<uint32_t, Real>> &point) {
+    if (any_of(point.begin(), point.end(), [&](const pair<uint32_t, Real> &c) { return c.first >= DIM; })) {
+      return false;
+    }
+    for (const auto &coordinate : point) {
+      indices.push_back(coordinate.first);
+      values.push_back(coordinate.second);
+    }
+    offsets.push_back(indices.size());
+    return true;
+  }
+
+  // Appends count points of another set of rows of the same dimension, starting at its point first
+  void append(const SparseRows &other, ll first, ll count) {
+    for (ll i = first; i < first + count; ++i) {
+      SparseRow<Real> point = other.row(i);
+      add(point.indices, point.values, point.nnz);
+    }
+  }
+
+  SparseRow<Real> row(ll i) const {
+    return {indices.data() + offsets[i], values.data() + offsets[i], (ll) (offsets[i + 1] - offsets[i])};
+  }
+
+  // Coordinates of a point as a dense vector
+  vector<Real> dense(ll i) const {
+    vector<Real> point(DIM, 0);
+    SparseRow<Real> sparse = row(i);
+    for (ll k = 0; k < sparse.nnz; ++k) {
+      point[sparse.indices[k]] += sparse.values[k];
+    }
+    return point;
+  }
+
+  ll size() const {
+    return (ll) offsets.size() - 1;
+  }
+
+  ll dim() const {
+    return DIM;
+  }
+
+  ll nonZeros() const {
+    return (ll) indices.size();
+  }
+
+  size_t bytes() const {
+    return offsets.capacity() * sizeof(uint64_t) + indices.capacity() * sizeof(uint32_t) +
+           values.capacity() * sizeof(Real);
+  }
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <vector>
+#include <chrono>
+#include <cstddef>
+#include "hashes.h"
+
+using namespace std;
+
+// Sizes of the buckets of one hash table
+// Large buckets dominate the cost of counting neighbors, which grows with the square of the bucket sizes
+struct BucketStats {
+  ll buckets = 0;
+  ll maxBucketSize = 0;
+  // histogram[k] counts the buckets of 2^k to 2^(k + 1) - 1 points
+  vector<ll> histogram;
+};
+
+// Percentiles of the wall time of score_batch calls, in seconds
+struct LatencyStats {
+  ll calls = 0;
+  ld p50 = 0, p90 = 0, p99 = 0, max = 0;
+};
+
+// What a trained LSHAD model spent and holds (see LSHAD::getStats)
+struct LSHADStats {
+  // Wall seconds of the phases of the last train
+  double tuningSeconds = 0, hashingSeconds = 0, estimationSeconds = 0, thresholdingSeconds = 0;
+
+  ll points = 0;
+  ll L = 0, T = 0;
+  ld w = 0, threshold = 0;
+
+  // One per table, and the largest bucket of all of them
+  vector<BucketStats> tables;
+  ll maxBucketSize = 0;
+
+  // Bytes held by the hash tables, the estimators, the stored points and the frozen model
+  size_t tableBytes = 0, estimatorBytes = 0, pointBytes = 0, modelBytes = 0;
+
+  // Only collected after LSHAD::setLatencyTracking
+  LatencyStats scoring;
+};
+
+// Measures the wall time of consecutive phases
+class Stopwatch {
+private:
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+public:
+  // Seconds since construction or the previous lap
+  double lap() {
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    double seconds = chrono::duration<double>(now - start).count();
+    start = now;
+    return seconds;
+  }
+};
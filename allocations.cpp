@@ -0,0 +1,112 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <new>
+#include <cstdlib>
+#include <atomic>
+#include "HashTables2.h"
+#include "LshadClass.h"
+
+using namespace std;
+
+// Heap allocations made so far, counted by the replacements of operator new below. They apply to the whole program,
+// which is why this test is built on its own rather than into the lshad command line tool
+atomic<ll> heapAllocations{0};
+
+void *operator new(size_t size) {
+  heapAllocations++;
+  void *memory = malloc(size > 0 ? size : 1);
+  if (memory == nullptr) {
+    throw bad_alloc();
+  }
+  return memory;
+}
+
+void *operator new(size_t size, align_val_t alignment) {
+  heapAllocations++;
+  size_t align = (size_t) alignment;
+  void *memory = aligned_alloc(align, (size + align - 1) / align * align);
+  if (memory == nullptr) {
+    throw bad_alloc();
+  }
+  return memory;
+}
+
+__attribute__((noinline)) void operator delete(void *memory) noexcept {
+  free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void *memory, size_t) noexcept {
+  free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void *memory, align_val_t) noexcept {
+  free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void *memory, size_t, align_val_t) noexcept {
+  free(memory);
+}
+
+// Once a window is full and scratch buffers have grown, inserting into the tables and scoring should not allocate
+// Warms a window up for a few turnovers, then counts the heap allocations of one more turnover and of scoring, and
+// returns their number
+ll testSteadyStateAllocations() {
+  ll L = 4, T = 50, window = 2000, batch = 100;
+  mt19937_64 gen(7);
+  uniform_real_distribution<ld> dis(-10.0, 10.0);
+  vector<ld> rows(batch * 3);
+  auto nextBatch = [&]() {
+    for (auto &x : rows) {
+      x = dis(gen);
+    }
+  };
+
+  HashTables<ld> tables(L, T, 5, 3, 1, 7);
+  BucketEstimators estimators(T);
+  vector<uint32_t> ids(batch);
+  for (ll i = 0; i < 10 * window; i += batch) {
+    nextBatch();
+    tables.insertWindowed(rows.data(), batch, window, estimators, ids.data());
+  }
+  ll steadyState = 0;
+  ll before = heapAllocations;
+  for (ll i = 0; i < window; i += batch) {
+    nextBatch();
+    tables.insertWindowed(rows.data(), batch, window, estimators, ids.data());
+  }
+  steadyState += heapAllocations - before;
+  cout << "Allocations inserting " << window << " points into a full window: " << heapAllocations - before << endl;
+
+  FrozenLSHADModel<ld> model(tables, estimators, 0);
+  FrozenLSHADModel<ld>::ScoringScratch scratch;
+  vector<ld> scores(batch);
+  model.score_batch(rows.data(), batch, 3, scores.data(), nullptr, scratch);
+  before = heapAllocations;
+  for (ll i = 0; i < 100; ++i) {
+    nextBatch();
+    model.score_batch(rows.data(), batch, 3, scores.data(), nullptr, scratch);
+  }
+  steadyState += heapAllocations - before;
+  cout << "Allocations scoring " << 100 * batch << " points: " << heapAllocations - before << endl;
+
+  LSHAD<> lshad;
+  vector<vector<ld>> data;
+  for (int i = 0; i < 1000; ++i) {
+    data.push_back({dis(gen), dis(gen), dis(gen)});
+  }
+  lshad.train(data, 0.01);
+  vector<ld> point = data[0];
+  lshad.detection_phase(point);
+  before = heapAllocations;
+  for (int i = 0; i < 1000; ++i) {
+    lshad.detection_phase(data[i]);
+  }
+  steadyState += heapAllocations - before;
+  cout << "Allocations detecting 1000 points: " << heapAllocations - before << endl;
+  return steadyState;
+}
+
+int main() {
+  return testSteadyStateAllocations() == 0 ? 0 : 1;
+}
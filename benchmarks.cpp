@@ -0,0 +1,392 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <random>
+#include <regex>
+#include <chrono>
+#include <ctime>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <unistd.h>
+#include "HashTables2.h"
+#include "LshadClass.h"
+
+using namespace std;
+
+// Benchmarks of the training and scoring phases on synthetic data of several sizes and dimensions
+// Usage: lshad_benchmarks [--filter=<regex>] [--out=<file>] [--sizes=1000,10000,...] [--dims=3,16,...]
+//                         [--max_values=<points * dim>] [--min_time=<seconds>] [--threads=<n>]
+// Every benchmark runs on every dataset whose points * dim is at most max_values, so --sizes=...,10000000 needs
+// a larger max_values too. Results are printed as a table and, with --out, written as JSON in the layout of Google
+// Benchmark, which its compare.py reads to track regressions between two runs
+
+// Points are floats so that the largest datasets fit in memory
+using Real = float;
+
+constexpr ll L = 4;
+constexpr ll T = 50;
+constexpr uint64_t SEED = 1;
+
+struct BenchmarkOptions {
+  string filter = ".*";
+  string out;
+  vector<ll> sizes{1000, 10000, 100000, 1000000};
+  vector<ll> dims{3, 16, 64, 512};
+  ll maxValues = 50000000;
+  double minTime = 0.5;
+  ll threads = 1;
+};
+
+// n points of the given dimension drawn uniformly from [minVal, maxVal] in every coordinate, as generatePointInRange
+vector<vector<Real>> generatePoints(ll n, ll dim, Real minVal, Real maxVal, uint64_t seed) {
+  mt19937_64 gen(seed);
+  uniform_real_distribution<Real> dis(minVal, maxVal);
+  vector<vector<Real>> points(n, vector<Real>(dim));
+  for (auto &point : points) {
+    for (auto &x : point) {
+      x = dis(gen);
+    }
+  }
+  return points;
+}
+
+// Training points and queries of one size and dimension, and what several benchmarks share, computed on first use
+class Dataset {
+private:
+  Real w = 0;
+  unique_ptr<LSHAD<Real>> model;
+
+public:
+  ll n, dim, threads;
+  vector<vector<Real>> points;
+  vector<Real> rows;
+  vector<vector<Real>> queries;
+
+  Dataset(ll n, ll dim, ll threads)
+      : n(n), dim(dim), threads(threads), points(generatePoints(n, dim, -10, 10, SEED)),
+        queries(generatePoints(1000, dim, -30, 30, SEED + 1)) {
+    rows.reserve(n * dim);
+    for (const auto &point : points) {
+      rows.insert(rows.end(), point.begin(), point.end());
+    }
+  }
+
+  // w tuned on a sample of the points
+  Real width() {
+    if (w == 0) {
+      SamplingOptions options;
+      options.seed = SEED;
+      w = (Real) HyperparameterTuner<Real>::tuneSampled(points, L, T, threads, options).w;
+    }
+    return w;
+  }
+
+  // Empty tables of the tuned w
+  HashTables<Real> *tables() {
+    return new HashTables<Real>(L, T, width(), dim, 1, SEED);
+  }
+
+  // Model trained on the points, w being tuned on a sample of them
+  LSHAD<Real> &trained() {
+    if (model == nullptr) {
+      model.reset(new LSHAD<Real>());
+      SamplingOptions options;
+      options.seed = SEED;
+      model->setSampledTuning(options);
+      model->setSeed(SEED);
+      model->setThreads(threads);
+      model->train(points, 0.01);
+    }
+    return *model;
+  }
+};
+
+// Timing of one benchmark on one dataset
+class BenchmarkState {
+private:
+  double minTime;
+
+public:
+  ll iterations = 0;
+  double realSeconds = 0, cpuSeconds = 0;
+  // Items, e.g. points, processed by one iteration
+  ll items = 0;
+
+  explicit BenchmarkState(double minTime) : minTime(minTime) {}
+
+  // Runs body after an untimed setup, as many times as needed for minTime seconds of body
+  template <typename Setup, typename Body>
+  void run(Setup setup, Body body) {
+    while (iterations == 0 || realSeconds < minTime) {
+      setup();
+      auto start = chrono::steady_clock::now();
+      clock_t cpuStart = clock();
+      body();
+      cpuSeconds += (double) (clock() - cpuStart) / CLOCKS_PER_SEC;
+      realSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+      iterations++;
+    }
+  }
+
+  template <typename Body>
+  void run(Body body) {
+    run([] {}, body);
+  }
+};
+
+struct Benchmark {
+  string name;
+  // Largest dataset the benchmark runs on, 0 for any
+  ll maxPoints;
+  function<void(Dataset &, BenchmarkState &)> body;
+};
+
+// Largest dataset of the benchmarks that estimate the neighbors of every point
+constexpr ll ESTIMATION_POINTS = 100000;
+
+// Points hashed per call when hashing a whole dataset, so the hash values of a call stay small
+constexpr ll HASH_BLOCK = 4096;
+
+vector<Benchmark> benchmarks() {
+  return {
+    {"HashTables/hash", 0, [](Dataset &data, BenchmarkState &state) {
+      unique_ptr<HashTables<Real>> tables(data.tables());
+      vector<ll> hash_values(L);
+      state.items = data.n;
+      state.run([&] {
+        for (ll i = 0; i < data.n; ++i) {
+          for (ll t = 0; t < T; ++t) {
+            tables->hash(data.rows.data() + i * data.dim, t, hash_values.data());
+          }
+        }
+      });
+    }},
+    {"HashTables/hashBatch", 0, [](Dataset &data, BenchmarkState &state) {
+      unique_ptr<HashTables<Real>> tables(data.tables());
+      vector<ll> hash_values(HASH_BLOCK * T * L);
+      state.items = data.n;
+      state.run([&] {
+        for (ll i = 0; i < data.n; i += HASH_BLOCK) {
+          tables->hashBatch(data.rows.data() + i * data.dim, min(HASH_BLOCK, data.n - i), hash_values.data());
+        }
+      });
+    }},
+    {"HashTables/insert", 0, [](Dataset &data, BenchmarkState &state) {
+      unique_ptr<HashTables<Real>> tables;
+      state.items = data.n;
+      state.run([&] {
+        tables.reset(data.tables());
+        tables->setThreads(data.threads);
+      }, [&] {
+        tables->insertBatch(data.rows.data(), data.n);
+      });
+    }},
+    {"HashTables/countNeighbors", 0, [](Dataset &data, BenchmarkState &state) {
+      unique_ptr<HashTables<Real>> tables(data.tables());
+      tables->insertBatch(data.rows.data(), data.n);
+      ll sample = min(data.n, 256LL);
+      state.items = sample;
+      state.run([&] {
+        for (ll i = 0; i < sample; ++i) {
+          tables->countNeighbors((uint32_t) (i * (data.n / sample)));
+        }
+      });
+    }},
+    // Estimating costs about the size of a bucket per point and table, a fixed fraction of the data for the tuned w,
+    // so the benchmarks that estimate are left out of the datasets beyond ESTIMATION_POINTS
+    {"HashTables/HashAndEstimatePerHash", ESTIMATION_POINTS, [](Dataset &data, BenchmarkState &state) {
+      unique_ptr<HashTables<Real>> tables;
+      state.items = data.n;
+      state.run([&] {
+        tables.reset(data.tables());
+        tables->setThreads(data.threads);
+      }, [&] {
+        tables->HashAndEstimatePerHash(data.points);
+      });
+    }},
+    // Tuning on a reservoir sample, the default
+    {"LSHAD/tuneHyperparameters", 0, [](Dataset &data, BenchmarkState &state) {
+      LSHAD<Real> lshad;
+      lshad.setSeed(SEED);
+      lshad.setThreads(data.threads);
+      state.items = data.n;
+      state.run([&] {
+        lshad.tuneHyperparameters(data.points);
+      });
+    }},
+    // The full tuner projects every point once for every table, so it is left out of the largest datasets
+    {"LSHAD/tuneHyperparametersFull", 1000000, [](Dataset &data, BenchmarkState &state) {
+      LSHAD<Real> lshad;
+      lshad.setSeed(SEED);
+      lshad.setThreads(data.threads);
+      lshad.setFullTuning();
+      state.items = data.n;
+      state.run([&] {
+        lshad.tuneHyperparameters(data.points);
+      });
+    }},
+    {"LSHAD/findThreshold", ESTIMATION_POINTS, [](Dataset &data, BenchmarkState &state) {
+      LSHAD<Real> &lshad = data.trained();
+      state.items = data.n;
+      state.run([&] {
+        lshad.findThreshold(lshad.getEstimators(), 0.01);
+      });
+    }},
+    {"LSHAD/detection_phase", ESTIMATION_POINTS, [](Dataset &data, BenchmarkState &state) {
+      LSHAD<Real> &lshad = data.trained();
+      state.items = data.queries.size();
+      state.run([&] {
+        for (const auto &query : data.queries) {
+          lshad.detection_phase(query);
+        }
+      });
+    }},
+    {"LSHAD/score_batch", ESTIMATION_POINTS, [](Dataset &data, BenchmarkState &state) {
+      LSHAD<Real> &lshad = data.trained();
+      vector<Real> rows;
+      for (const auto &query : data.queries) {
+        rows.insert(rows.end(), query.begin(), query.end());
+      }
+      vector<ld> scores(data.queries.size());
+      state.items = data.queries.size();
+      state.run([&] {
+        lshad.score_batch(rows.data(), data.queries.size(), data.dim, scores.data(), nullptr);
+      });
+    }},
+  };
+}
+
+vector<ll> parseList(const string &list) {
+  vector<ll> values;
+  stringstream stream(list);
+  string value;
+  while (getline(stream, value, ',')) {
+    values.push_back(stoll(value));
+  }
+  return values;
+}
+
+// Returns false on an unknown argument
+bool parseOptions(int argc, char **argv, BenchmarkOptions &options) {
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    size_t eq = arg.find('=');
+    string key = arg.substr(0, eq), value = eq == string::npos ? "" : arg.substr(eq + 1);
+    if (key == "--filter") {
+      options.filter = value;
+    } else if (key == "--out") {
+      options.out = value;
+    } else if (key == "--sizes") {
+      options.sizes = parseList(value);
+    } else if (key == "--dims") {
+      options.dims = parseList(value);
+    } else if (key == "--max_values") {
+      options.maxValues = stoll(value);
+    } else if (key == "--min_time") {
+      options.minTime = stod(value);
+    } else if (key == "--threads") {
+      options.threads = stoll(value);
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+string jsonString(const string &s) {
+  string quoted = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      quoted += '\\';
+    }
+    quoted += c;
+  }
+  return quoted + "\"";
+}
+
+int main(int argc, char **argv) {
+  BenchmarkOptions options;
+  if (!parseOptions(argc, argv, options)) {
+    cerr << "Usage: " << argv[0] << " [--filter=<regex>] [--out=<file>] [--sizes=<n,...>] [--dims=<d,...>]"
+         << " [--max_values=<points * dim>] [--min_time=<seconds>] [--threads=<n>]" << endl;
+    return 1;
+  }
+  regex filter(options.filter);
+  vector<Benchmark> suite = benchmarks();
+
+  char host[256] = "";
+  gethostname(host, sizeof(host) - 1);
+  time_t now = time(nullptr);
+  char date[32];
+  strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+
+  stringstream results;
+  results << "{\n  \"context\": {\n"
+          << "    \"date\": " << jsonString(date) << ",\n"
+          << "    \"host_name\": " << jsonString(host) << ",\n"
+          << "    \"executable\": " << jsonString(argv[0]) << ",\n"
+          << "    \"num_cpus\": " << thread::hardware_concurrency() << ",\n"
+          << "    \"threads\": " << options.threads << ",\n"
+          << "    \"L\": " << L << ",\n"
+          << "    \"T\": " << T << ",\n"
+          << "    \"real_size\": " << sizeof(Real) << "\n"
+          << "  },\n  \"benchmarks\": [";
+  bool first = true;
+
+  printf("%-48s %14s %14s %10s %14s\n", "Benchmark", "Time (ns)", "CPU (ns)", "Iterations", "Items/s");
+  for (ll dim : options.dims) {
+    for (ll n : options.sizes) {
+      if (n * dim > options.maxValues) {
+        continue;
+      }
+      unique_ptr<Dataset> data;
+      for (const Benchmark &benchmark : suite) {
+        string name = benchmark.name + "/" + to_string(n) + "/" + to_string(dim);
+        if (!regex_search(name, filter) || (benchmark.maxPoints > 0 && n > benchmark.maxPoints)) {
+          continue;
+        }
+        if (data == nullptr) {
+          data.reset(new Dataset(n, dim, options.threads));
+        }
+
+        BenchmarkState state(options.minTime);
+        benchmark.body(*data, state);
+
+        double realTime = state.realSeconds / state.iterations * 1e9;
+        double cpuTime = state.cpuSeconds / state.iterations * 1e9;
+        double itemsPerSecond = state.items * state.iterations / state.realSeconds;
+        printf("%-48s %14.0f %14.0f %10lld %14.4g\n", name.c_str(), realTime, cpuTime, state.iterations,
+               itemsPerSecond);
+        fflush(stdout);
+
+        results << (first ? "\n" : ",\n") << "    {\n"
+                << "      \"name\": " << jsonString(name) << ",\n"
+                << "      \"run_name\": " << jsonString(name) << ",\n"
+                << "      \"run_type\": \"iteration\",\n"
+                << "      \"iterations\": " << state.iterations << ",\n"
+                << "      \"real_time\": " << realTime << ",\n"
+                << "      \"cpu_time\": " << cpuTime << ",\n"
+                << "      \"time_unit\": \"ns\",\n"
+                << "      \"items_per_second\": " << itemsPerSecond << ",\n"
+                << "      \"points\": " << n << ",\n"
+                << "      \"dim\": " << dim << "\n"
+                << "    }";
+        first = false;
+      }
+    }
+  }
+  results << "\n  ]\n}\n";
+
+  if (!options.out.empty()) {
+    ofstream file(options.out);
+    file << results.str();
+    if (!file) {
+      cerr << "Cannot write " << options.out << endl;
+      return 1;
+    }
+  }
+  return 0;
+}
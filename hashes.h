@@ -39,10 +39,11 @@ struct InnerMapEqual {
 
 
 struct VectorHash {
-  size_t operator()(const vector<ld>& v) const {
-    std::hash<ld> hasher;
+  template <typename Real>
+  size_t operator()(const vector<Real>& v) const {
+    std::hash<Real> hasher;
     size_t seed = 0;
-    for (ld i : v) {
+    for (Real i : v) {
       seed ^= hasher(i) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
     }
     return seed;
@@ -50,7 +51,8 @@ struct VectorHash {
 };
 
 struct VectorEqual {
-  bool operator()(const vector<ld>& lhs, const vector<ld>& rhs) const {
+  template <typename Real>
+  bool operator()(const vector<Real>& lhs, const vector<Real>& rhs) const {
     return lhs == rhs;
   }
 };
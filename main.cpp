@@ -2,6 +2,12 @@
 #include <vector>
 #include <random>
 #include <fstream>
+#include <limits>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <unistd.h>
+#include <sys/wait.h>
 #include "HashTables2.h"
 #include "LshadClass.h"
 
@@ -77,7 +83,34 @@ void writePointsToFile(const vector<vector<ld>>& data, const string& filename) {
   }
 }
 
-void testLSHATrain(LSHAD &lshad) {
+void printStats(const LSHADStats &stats) {
+  cout << "L: " << stats.L << " T: " << stats.T << " w: " << stats.w << " threshold: " << stats.threshold << endl;
+  cout << "Seconds tuning " << stats.tuningSeconds << ", hashing " << stats.hashingSeconds << ", estimating "
+       << stats.estimationSeconds << ", thresholding " << stats.thresholdingSeconds << endl;
+  cout << "Bytes of tables " << stats.tableBytes << ", estimators " << stats.estimatorBytes << ", points "
+       << stats.pointBytes << ", model " << stats.modelBytes << endl;
+
+  // Bucket size histogram of all the tables together
+  vector<ll> histogram;
+  for (const auto &table : stats.tables) {
+    histogram.resize(max(histogram.size(), table.histogram.size()), 0);
+    for (size_t k = 0; k < table.histogram.size(); ++k) {
+      histogram[k] += table.histogram[k];
+    }
+  }
+  cout << "Largest bucket " << stats.maxBucketSize << " points, buckets by size:";
+  for (size_t k = 0; k < histogram.size(); ++k) {
+    cout << " [" << (1LL << k) << ", " << (1LL << (k + 1)) << "): " << histogram[k];
+  }
+  cout << endl;
+
+  if (stats.scoring.calls > 0) {
+    cout << "Scoring latency over " << stats.scoring.calls << " calls: p50 " << stats.scoring.p50 << " s, p90 "
+         << stats.scoring.p90 << " s, p99 " << stats.scoring.p99 << " s, max " << stats.scoring.max << " s" << endl;
+  }
+}
+
+void testLSHATrain(LSHAD<> &lshad) {
   int numPoints = 99;
   int numClosePoints = numPoints * 0.9;
   int numFarPoints = numPoints - numClosePoints;
@@ -101,12 +134,14 @@ void testLSHATrain(LSHAD &lshad) {
   shuffle(data.begin(), data.end(), g);
 
   writePointsToFile(data, "points.txt");
+  lshad.setLatencyTracking(true);
   lshad.train(data, (ld) 0.01);
 
   vector<ld> query2 = {10000000.21, 141242141.0, 24124243.0};
 
   cout << lshad.detection_phase(query1) << endl;
   cout << lshad.detection_phase(query2) << endl;
+  printStats(lshad.getStats());
 
   // 0.1
   //   tuple<ll, ll, ld> hyperparameters = lshad.tuneHyperparameters(data);
@@ -158,12 +193,776 @@ void testEstPerHash() {
   };
   LSHAD lshad;
   lshad.train(data, (ld) 0.1);
+  printStats(lshad.getStats());
+}
+
+// Compares the w tuned on a sample of the data with the w tuned on all of it
+void testSampledTuning() {
+  ll numPoints = 200000;
+  vector<vector<ld>> data;
+  for (ll i = 0; i < numPoints; ++i) {
+    data.push_back(generatePointInRange(-10.0, 10.0));
+  }
+
+  TuningReport full = HyperparameterTuner<ld>(data, 4, 50).tune();
+
+  SamplingOptions options;
+  options.sampleSize = 5000;
+  TuningReport sampled = HyperparameterTuner<ld>::tuneSampled(data, 4, 50, 1, options);
+
+  // Average bucket size over the whole data for the w chosen on the sample
+  LSHAD<> lshad;
+  ld sampledOnFull = lshad.hashGroupAndCount(data, 4, 50, sampled.w);
+
+  cout << "Full data: w = " << full.w << " average bucket size = " << full.averageBucketSize
+       << " (" << full.totalSeconds << "s)" << endl;
+  cout << "Sample of " << sampled.sampleSize << ": w = " << sampled.w << " average bucket size = "
+       << sampled.averageBucketSize << " (" << sampled.totalSeconds << "s)" << endl;
+  cout << "Relative difference in w: " << fabsl(sampled.w - full.w) / full.w << endl;
+  cout << "Average bucket size on the full data with the sampled w: " << sampledOnFull << endl;
+}
+
+// Scores from one thread while another updates a windowed model; build with -fsanitize=thread to check that
+// publishing the updated models does not race with scoring
+void testUpdateWhileScoring() {
+  mt19937_64 gen(3);
+  uniform_real_distribution<ld> dis(-10.0, 10.0);
+  vector<vector<ld>> data;
+  for (int i = 0; i < 2000; ++i) {
+    data.push_back({dis(gen), dis(gen), dis(gen)});
+  }
+  LSHAD<> lshad;
+  lshad.setWindow(2000);
+  lshad.train(data, 0.05);
+
+  atomic<bool> done{false};
+  atomic<ll> batches{0}, failures{0};
+  thread scorer([&] {
+    vector<ld> rows, scores(100);
+    for (int i = 0; i < 100; ++i) {
+      rows.insert(rows.end(), data[i].begin(), data[i].end());
+    }
+    while (!done) {
+      failures += !lshad.score_batch(rows.data(), 100, 3, scores.data(), nullptr);
+      batches++;
+    }
+  });
+  for (int r = 0; r < 30; ++r) {
+    vector<vector<ld>> batch;
+    for (int i = 0; i < 100; ++i) {
+      batch.push_back({dis(gen), dis(gen), dis(gen)});
+    }
+    lshad.update(batch);
+  }
+  done = true;
+  scorer.join();
+  cout << "Batches scored during 30 updates: " << batches << ", failed: " << failures << endl;
+}
+
+// Measures the points scored per second by several threads sharing one frozen model
+void benchmarkConcurrentScoring() {
+  vector<vector<double>> data;
+  for (int i = 0; i < 20000; ++i) {
+    vector<ld> point = generatePointInRange(-10.0, 10.0);
+    data.emplace_back(point.begin(), point.end());
+  }
+  LSHAD<double> lshad;
+  lshad.setSampledTuning(SamplingOptions());
+  lshad.train(data, (ld) 0.01);
+  shared_ptr<const FrozenLSHADModel<double>> model = lshad.getFrozenModel();
+
+  // Queries, row-major
+  ll numQueries = 200000;
+  vector<double> queries;
+  for (ll i = 0; i < numQueries; ++i) {
+    vector<ld> point = generatePointInRange(-12.0, 12.0);
+    queries.insert(queries.end(), point.begin(), point.end());
+  }
+
+  ll maxThreads = max(1u, thread::hardware_concurrency());
+  double singleThreadRate = 0;
+  for (ll threads = 1; threads <= maxThreads; threads *= 2) {
+    vector<thread> pool;
+    auto start = chrono::steady_clock::now();
+    for (ll worker = 0; worker < threads; ++worker) {
+      pool.emplace_back([&, worker]() {
+        vector<ld> scores(numQueries);
+        unique_ptr<bool[]> flags(new bool[numQueries]);
+        model->score_batch(queries.data(), numQueries, 3, scores.data(), flags.get());
+      });
+    }
+    for (auto &th : pool) {
+      th.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    double rate = numQueries * threads / seconds;
+    if (threads == 1) {
+      singleThreadRate = rate;
+    }
+    cout << "Threads: " << threads << " points/s: " << rate << " speedup: " << rate / singleThreadRate << endl;
+  }
+}
+
+// Checks that a model saved to disk and mapped back scores points like the trained one
+void testModelSaveAndLoad() {
+  vector<vector<double>> data;
+  for (int i = 0; i < 2000; ++i) {
+    vector<ld> point = generatePointInRange(-10.0, 10.0);
+    data.emplace_back(point.begin(), point.end());
+  }
+  LSHAD<double> lshad;
+  lshad.train(data, (ld) 0.01);
+  lshad.saveModel("model.lshad");
+
+  auto start = chrono::steady_clock::now();
+  shared_ptr<const FrozenLSHADModel<double>> loaded = FrozenLSHADModel<double>::load("model.lshad");
+  double loadSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  ll mismatches = 0;
+  for (int i = 0; i < 1000; ++i) {
+    vector<ld> generated = generatePointInRange(-12.0, 12.0);
+    vector<double> point(generated.begin(), generated.end());
+    ld expected, actual;
+    lshad.score_batch(point.data(), 1, 3, &expected, nullptr);
+    loaded->score_batch(point.data(), 1, 3, &actual, nullptr);
+    mismatches += expected != actual;
+  }
+
+  // Truncated copies of the file and copies with a corrupt header or table must be rejected
+  ifstream file("model.lshad", ios::binary);
+  string bytes((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+  auto rejects = [&](const string &corrupt) {
+    ofstream("corrupt.lshad", ios::binary | ios::trunc).write(corrupt.data(), corrupt.size());
+    return FrozenLSHADModel<double>::load("corrupt.lshad") == nullptr;
+  };
+  ll rejected = 0, corrupted = 0;
+  for (ll k = 1; k < 10; ++k, ++corrupted) {
+    rejected += rejects(bytes.substr(0, bytes.size() * k / 10));
+  }
+  ModelHeader header;
+  memcpy(&header, bytes.data(), sizeof(header));
+  auto withEntry = [&](auto change) {
+    string corrupt = bytes;
+    ModelTableEntry entry;
+    memcpy(&entry, corrupt.data() + header.tablesOffset, sizeof(entry));
+    change(entry);
+    memcpy(&corrupt[header.tablesOffset], &entry, sizeof(entry));
+    return corrupt;
+  };
+  auto withHeader = [&](auto change) {
+    string corrupt = bytes;
+    ModelHeader changed = header;
+    change(changed);
+    memcpy(&corrupt[0], &changed, sizeof(changed));
+    return corrupt;
+  };
+  vector<string> corrupt = {
+    withEntry([](ModelTableEntry &entry) { entry.slotCount = 3; }),
+    withEntry([](ModelTableEntry &entry) { entry.slotsOffset = 1ULL << 40; }),
+    withEntry([](ModelTableEntry &entry) { entry.entryCount = 1ULL << 62; }),
+    withHeader([](ModelHeader &changed) { changed.T = 1LL << 40; }),
+    withHeader([](ModelHeader &changed) { changed.L = 0; }),
+    withHeader([](ModelHeader &changed) { changed.estimatorCount = 1ULL << 61; }),
+    withHeader([](ModelHeader &changed) { changed.alphasOffset += MODEL_ALIGNMENT * 1000000; }),
+    withHeader([](ModelHeader &changed) {
+      changed.regenerateProjections = 1;
+      changed.seed = 1;
+      changed.dim = 1LL << 32;
+    }),
+  };
+  // Every slot occupied with distances that never stop a missing lookup
+  ModelTableEntry entry;
+  memcpy(&entry, bytes.data() + header.tablesOffset, sizeof(entry));
+  string fullSlots = bytes;
+  for (uint64_t slot = 0; slot < entry.slotCount; ++slot) {
+    FlatSlot full{slot, 0, UINT32_MAX};
+    memcpy(&fullSlots[entry.slotsOffset + slot * sizeof(FlatSlot)], &full, sizeof(full));
+  }
+  corrupt.push_back(fullSlots);
+  for (const auto &copy : corrupt) {
+    rejected += rejects(copy);
+    corrupted++;
+  }
+
+  cout << "Model size: " << loaded->bytes() << " bytes, loaded in " << loadSeconds * 1000 << " ms" << endl;
+  cout << "Corrupt copies rejected: " << rejected << " of " << corrupted << endl;
+  cout << (mismatches == 0 && rejected == corrupted ? "OK" : "FAILED") << endl;
+}
+
+vector<vector<ld>> readPointsFromFile(const string& filename) {
+  CsvSource<ld> source(filename);
+  vector<vector<ld>> data;
+  vector<ld> rows;
+  for (ll count = source.next(rows, 1024); count > 0; count = source.next(rows, 1024)) {
+    for (ll i = 0; i < count; ++i) {
+      data.emplace_back(rows.begin() + i * source.dim(), rows.begin() + (i + 1) * source.dim());
+    }
+  }
+  return data;
+}
+
+// Trains from points.txt and from the same points as a binary matrix, reading both in chunks
+void testStreamingTraining() {
+  CsvSource<double> csv("points.txt");
+  LSHAD<double> fromCsv;
+  cout << (fromCsv.train(csv, (ld) 0.01, 16) ? "Trained from CSV" : csv.error()) << endl;
+
+  vector<vector<ld>> data = readPointsFromFile("points.txt");
+  ofstream binary("points.bin", ios::binary);
+  for (const auto& point : data) {
+    for (ld coord : point) {
+      double value = (double) coord;
+      binary.write(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+  }
+  binary.close();
+
+  BinaryMatrixSource<double> matrix("points.bin", 3);
+  LSHAD<double> fromBinary;
+  cout << (fromBinary.train(matrix, (ld) 0.01, 16) ? "Trained from binary matrix" : matrix.error()) << endl;
+
+  // However often the sample grows, the source is read once to sample it and once more to hash it
+  struct CountingSource : CsvSource<double> {
+    ll rewinds = 0;
+    explicit CountingSource(const string &path) : CsvSource<double>(path) {}
+    void rewind() override {
+      rewinds++;
+      CsvSource<double>::rewind();
+    }
+  };
+  CountingSource counted("points.txt");
+  LSHAD<double> growing;
+  growing.setSampledTuning({10, 100, 0, 1});
+  growing.train(counted, (ld) 0.01, 16);
+  // One rewind reads the first row to check the source is not empty
+  cout << "Passes over the source: " << counted.rewinds - 1 << endl;
+
+  // Empty, header-only and zero-dimensional sources are rejected, and the model trained before is kept
+  ofstream("empty.txt", ios::trunc) << "";
+  ofstream("header.txt", ios::trunc) << "x,y,z\n";
+  CsvSource<double> empty("empty.txt"), headerOnly("header.txt", true);
+  BinaryMatrixSource<double> zeroDim("points.bin", 0);
+  auto before = fromBinary.getFrozenModel();
+  bool rejected = !fromBinary.train(empty, (ld) 0.01) && !fromBinary.train(headerOnly, (ld) 0.01) &&
+                  !fromBinary.train(zeroDim, (ld) 0.01);
+  cout << "Empty sources rejected: " << (rejected ? "yes" : "no") << ", model kept: "
+       << (fromBinary.getFrozenModel() == before ? "yes" : "no") << endl;
+}
+
+// Counts the hash values of the data that a lower precision model computes differently from the long double one,
+// and how many of those differences are not explained by the point lying within rounding error of a bin boundary
+template <typename Real>
+pair<ll, ll> countHashMismatches(HashTables<ld> &reference, const vector<vector<ld>>& data, ll L, ll T) {
+  const ProjectionMatrix<ld> &projections = reference.getProjections();
+  HashTables<Real> hasher(L, T, ProjectionMatrix<Real>(projections));
+  ld w = projections.width();
+  ld epsilon = numeric_limits<Real>::epsilon();
+
+  ll mismatches = 0;
+  ll unexplained = 0;
+  vector<ll> expected(T * L), actual(T * L);
+  for (const auto& point : data) {
+    vector<Real> converted(point.begin(), point.end());
+    reference.hashBatch(point.data(), 1, expected.data());
+    hasher.hashBatch(converted.data(), 1, actual.data());
+    for (ll r = 0; r < T * L; ++r) {
+      if (expected[r] == actual[r]) {
+        continue;
+      }
+      mismatches++;
+
+      // Error bound of the lower precision dot product, plus the rounding of the inputs
+      ld magnitude = fabsl(projections.beta(r));
+      for (ll d = 0; d < (ll) point.size(); ++d) {
+        magnitude += fabsl(point[d] * projections.alpha(r)[d]);
+      }
+      ld bound = ((ld) point.size() + 4) * epsilon * magnitude / w;
+      ld position = (dot_product(point.data(), projections.alpha(r), (ll) point.size()) + projections.beta(r)) / w;
+      ld distanceToBoundary = fabsl(position - roundl(position));
+      if (distanceToBoundary > bound) {
+        unexplained++;
+      }
+    }
+  }
+  return make_pair(mismatches, unexplained);
+}
+
+// Checks that the float and double models put the points of points.txt in the same buckets as the long double one
+void testNumericTypesAgree() {
+  ll L = 4;
+  ll T = 50;
+  ld w = 5;
+
+  vector<vector<ld>> data = readPointsFromFile("points.txt");
+  HashTables<ld> reference(L, T, w, data[0].size());
+
+  ll total = (ll) data.size() * T * L;
+  pair<ll, ll> doubleMismatches = countHashMismatches<double>(reference, data, L, T);
+  pair<ll, ll> floatMismatches = countHashMismatches<float>(reference, data, L, T);
+
+  cout << "double: " << doubleMismatches.first << " of " << total << " hash values differ, "
+       << doubleMismatches.second << " not at a bin boundary" << endl;
+  cout << "float: " << floatMismatches.first << " of " << total << " hash values differ, "
+       << floatMismatches.second << " not at a bin boundary" << endl;
+  cout << (doubleMismatches.second == 0 && floatMismatches.second == 0 ? "OK" : "FAILED") << endl;
+}
+
+// Inserts the second half of points.txt online and checks the estimators of the buckets it touched against hashing
+// all the points at once with the same projections, then updates a trained model with points far from it
+void testOnlineUpdate() {
+  ll L = 4;
+  ll T = 50;
+  ld w = 5;
+
+  vector<vector<ld>> data = readPointsFromFile("points.txt");
+  vector<vector<ld>> firstHalf(data.begin(), data.begin() + data.size() / 2);
+  vector<vector<ld>> secondHalf(data.begin() + data.size() / 2, data.end());
+
+  HashTables<ld> online(L, T, w, data[0].size());
+  BucketEstimators estPerHash = online.HashAndEstimatePerHash(firstHalf);
+  uint32_t first = (uint32_t) online.size();
+  online.insertBatch(secondHalf);
+  online.updateEstimators(first, estPerHash);
+
+  HashTables<ld> batch(L, T, online.getProjections());
+  BucketEstimators expected = batch.HashAndEstimatePerHash(data);
+
+  ll differ = 0;
+  for (uint32_t id = first; id < (uint32_t) online.size(); ++id) {
+    for (ll t = 0; t < T; ++t) {
+      uint32_t bucket = online.getBucketsOfPoint(id)[t];
+      ll found = batch.getTables()[t].find(online.getTables()[t].key(bucket));
+      if (found < 0 || estPerHash[t][bucket] != expected[t][found]) {
+        differ++;
+      }
+    }
+  }
+  cout << "Touched buckets with a different estimator: " << differ << endl;
+
+  LSHAD<> lshad;
+  lshad.train(firstHalf, 0.1);
+  vector<vector<ld>> drifted;
+  for (int i = 0; i < 20; ++i) {
+    drifted.push_back(generatePointInRange(50.0, 60.0));
+  }
+  auto start = chrono::high_resolution_clock::now();
+  lshad.update(drifted);
+  auto end = chrono::high_resolution_clock::now();
+  cout << "Update of " << drifted.size() << " points: "
+       << chrono::duration<double, milli>(end - start).count() << " ms, threshold "
+       << lshad.getFrozenModel()->getThreshold() << endl;
+}
+
+// Tunes the number of tables of a model probing 2 buckets per table against a single-probe model of 50 tables,
+// on points in one range, the far away points of the validation set being the anomalies
+void testMultiProbe() {
+  vector<vector<ld>> data;
+  for (int i = 0; i < 2000; ++i) {
+    data.push_back(generatePointInRange(-10.0, 10.0));
+  }
+  vector<vector<ld>> validation;
+  vector<bool> anomalous;
+  for (int i = 0; i < 475; ++i) {
+    validation.push_back(generatePointInRange(-10.0, 10.0));
+    anomalous.push_back(false);
+  }
+  for (int i = 0; i < 25; ++i) {
+    validation.push_back(generatePointInTwoRanges(-30.0, -15.0, 15.0, 30.0));
+    anomalous.push_back(true);
+  }
+
+  LSHAD<> lshad;
+  TableTuningReport report = lshad.tuneTables(data, validation, anomalous, 0.05, 2);
+  for (const auto &candidate : report.candidates) {
+    cout << "T: " << candidate.T << " probes: " << candidate.probes << " F1: " << candidate.f1
+         << " held out: " << candidate.heldOutF1 << " bytes: " << candidate.bytes << " scoring: " << candidate.scoringSeconds * 1e6 / validation.size()
+         << " us per point" << endl;
+  }
+  cout << "Chosen T: " << report.T << " probes: " << report.probes << endl;
+}
+
+// Tunes L, T and w against a budget of 30 kB per model, on the same data as testMultiProbe
+void testShapeTuning() {
+  vector<vector<ld>> data;
+  for (int i = 0; i < 2000; ++i) {
+    data.push_back(generatePointInRange(-10.0, 10.0));
+  }
+  vector<vector<ld>> validation;
+  vector<bool> anomalous;
+  for (int i = 0; i < 475; ++i) {
+    validation.push_back(generatePointInRange(-10.0, 10.0));
+    anomalous.push_back(false);
+  }
+  for (int i = 0; i < 25; ++i) {
+    validation.push_back(generatePointInTwoRanges(-30.0, -15.0, 15.0, 30.0));
+    anomalous.push_back(true);
+  }
+
+  TuningBudget budget;
+  budget.maxModelBytes = 30000;
+  LSHAD<> lshad;
+  ShapeTuningReport report = lshad.tuneShape(data, validation, anomalous, 0.05, budget);
+  cout << "Pareto set:" << endl;
+  for (const auto &candidate : report.pareto) {
+    cout << "L: " << candidate.L << " T: " << candidate.T << " w: " << candidate.w << " F1: " << candidate.f1
+         << " held out: " << candidate.heldOutF1 << " bytes: " << candidate.bytes << " scoring: " << candidate.secondsPerPoint * 1e6 << " us per point"
+         << (candidate.withinBudget ? "" : " (over budget)") << endl;
+  }
+  cout << "Chosen L: " << report.L << " T: " << report.T << " w: " << report.w << endl;
+
+  TuningBudget empty;
+  empty.Ts.clear();
+  ShapeTuningReport unchanged = lshad.tuneShape(data, validation, anomalous, 0.05, empty);
+  cout << "Empty grid rejected: "
+       << (unchanged.candidates.empty() && unchanged.L == report.L && unchanged.T == report.T ? "yes" : "no") << endl;
+}
+
+// Sparse point of dim coordinates with nnz non-zero ones, drawn among the first features coordinates
+vector<pair<uint32_t, ld>> generateSparsePoint(ll dim, ll nnz, ll features) {
+  random_device rd;
+  mt19937 gen(rd());
+  uniform_int_distribution<ll> index(0, min(dim, features) - 1);
+  uniform_real_distribution<ld> value(0.5, 1.5);
+
+  vector<pair<uint32_t, ld>> point;
+  for (ll k = 0; k < nnz; ++k) {
+    point.emplace_back((uint32_t) index(gen), value(gen));
+  }
+  return point;
+}
+
+// Trains on 100k-dimensional points with 50 non-zeros drawn among 200 common features, and scores points whose
+// non-zeros are spread over the whole space; also checks that sparse and dense points of a smaller space hash alike
+void testSparseInput() {
+  ll dim = 100000;
+  SparseRows<ld> data(dim);
+  for (int i = 0; i < 5000; ++i) {
+    data.add(generateSparsePoint(dim, 50, 200));
+  }
+  SparseRows<ld> queries(dim);
+  for (int i = 0; i < 10; ++i) {
+    queries.add(generateSparsePoint(dim, 50, 200));
+  }
+  for (int i = 0; i < 10; ++i) {
+    queries.add(generateSparsePoint(dim, 50, dim));
+  }
+
+  LSHAD<> lshad;
+  auto start = chrono::high_resolution_clock::now();
+  lshad.train(data, 0.01);
+  auto end = chrono::high_resolution_clock::now();
+  cout << "Trained in " << chrono::duration<double>(end - start).count() << " s, model "
+       << lshad.getFrozenModel()->bytes() << " bytes" << endl;
+
+  ld scores[20];
+  bool flags[20];
+  lshad.score_batch(queries, 0, 20, scores, flags);
+  for (int i = 0; i < 20; ++i) {
+    cout << (i < 10 ? "Common features: " : "Spread features: ") << scores[i] << (flags[i] ? " anomaly" : "") << endl;
+  }
+
+  // Sparse updates only go into a model trained on sparse points of the same dimension and without a window
+  SparseRows<ld> otherDim(dim + 1);
+  otherDim.add(generateSparsePoint(dim + 1, 50, 200));
+  LSHAD<> dense, windowed;
+  dense.train(vector<vector<ld>>{queries.dense(0), queries.dense(1), queries.dense(2)}, 0.1);
+  windowed.setWindow(1000);
+  windowed.train(data, 0.01);
+  bool checked = lshad.update(queries) && !lshad.update(otherDim) &&
+                 !lshad.update(vector<vector<ld>>{queries.dense(0)}) && !dense.update(queries) &&
+                 !windowed.update(queries);
+  cout << "Sparse update preconditions checked: " << (checked ? "yes" : "no") << endl;
+  SparseRows<ld> outOfRange(dim);
+  bool rejected = !outOfRange.add({{(uint32_t) dim, 1}}) && outOfRange.size() == 0 && outOfRange.add({{0, 1}});
+  cout << "Indices out of range rejected: " << (rejected ? "yes" : "no") << endl;
+
+  ll smallDim = 500;
+  HashTables<ld> hasher(4, 50, 5, smallDim);
+  ll mismatches = 0;
+  vector<ll> sparseHash(50 * 4), denseHash(50 * 4);
+  for (int i = 0; i < 100; ++i) {
+    SparseRows<ld> point(smallDim);
+    point.add(generateSparsePoint(smallDim, 20, smallDim));
+    hasher.hashBatch(point, 0, 1, sparseHash.data());
+    hasher.hashBatch(point.dense(0).data(), 1, denseHash.data());
+    mismatches += sparseHash != denseHash;
+  }
+  cout << "Points hashed differently as sparse and dense: " << mismatches << endl;
+}
+
+// Two models trained with the same seed should have the same projections and scores, also when one of them is saved
+// without its projection matrix and generates it again when loaded
+void testSeededProjections() {
+  vector<vector<ld>> data;
+  for (int i = 0; i < 2000; ++i) {
+    data.push_back(generatePointInRange(-10.0, 10.0));
+  }
+  vector<ld> queries;
+  for (int i = 0; i < 100; ++i) {
+    vector<ld> point = generatePointInRange(-30.0, 30.0);
+    queries.insert(queries.end(), point.begin(), point.end());
+  }
+
+  LSHAD<> first, second;
+  first.setSeed(42);
+  second.setSeed(42);
+  first.train(data, 0.01);
+  second.train(data, 0.01);
+
+  first.saveModel("seeded_full.lshad");
+  first.saveModel("seeded_compact.lshad", false);
+  auto full = FrozenLSHADModel<ld>::load("seeded_full.lshad");
+  auto compact = FrozenLSHADModel<ld>::load("seeded_compact.lshad");
+  cout << "Model with projections " << full->bytes() << " bytes, without " << compact->bytes() << " bytes" << endl;
+
+  ll dim = data[0].size();
+  vector<ld> firstScores(100), secondScores(100), compactScores(100);
+  first.score_batch(queries.data(), 100, dim, firstScores.data(), nullptr);
+  second.score_batch(queries.data(), 100, dim, secondScores.data(), nullptr);
+  compact->score_batch(queries.data(), 100, dim, compactScores.data(), nullptr);
+  cout << "Same seed, same scores: " << (firstScores == secondScores ? "yes" : "no") << endl;
+  cout << "Regenerated projections, same scores: " << (firstScores == compactScores ? "yes" : "no") << endl;
+
+  ProjectionMatrix<float> a(50, 4, 10000, 1, 1, 7), b(50, 4, 10000, 1, 1, 7);
+  ProjectionView<float> va = a.view(), vb = b.view();
+  bool same = memcmp(va.alphas, vb.alphas, 200 * 10000 * sizeof(float)) == 0 &&
+              memcmp(va.betas, vb.betas, 200 * sizeof(float)) == 0;
+  cout << "Same seed, same projection matrix: " << (same ? "yes" : "no") << endl;
+
+  auto start = chrono::high_resolution_clock::now();
+  ProjectionMatrix<float> dense(50, 4, 100000, 1, 1, 7);
+  auto end = chrono::high_resolution_clock::now();
+  cout << "Dense 200 x 100000 projections generated in " << chrono::duration<double>(end - start).count() << " s"
+       << endl;
+  start = chrono::high_resolution_clock::now();
+  ProjectionMatrix<float> sparse(50, 4, 100000, 1, 1 / sqrtl(100000), 7);
+  end = chrono::high_resolution_clock::now();
+  cout << "Sparse 200 x 100000 projections generated in " << chrono::duration<double>(end - start).count() << " s"
+       << endl;
+}
+
+// Scores of models of specialized and generic shapes (see dispatchShape) against the generic hashing and lookups
+void testSpecializedKernels() {
+  vector<pair<ll, ll>> shapes = {{3, 4}, {16, 4}, {32, 2}, {8, 6}, {5, 4}, {3, 5}};
+  mt19937_64 gen(11);
+  uniform_real_distribution<ld> dis(-10.0, 10.0);
+  ll T = 20, n = 2000;
+
+  for (const auto &shape : shapes) {
+    ll dim = shape.first, L = shape.second;
+    vector<ld> rows(n * dim);
+    for (auto &x : rows) {
+      x = dis(gen);
+    }
+    HashTables<ld> tables(L, T, 4 * sqrtl(dim), dim, 1, 11);
+    tables.insertBatch(rows.data(), n);
+    BucketEstimators estimators = tables.estimatePerHash();
+    FrozenLSHADModel<ld> model(tables, estimators, 0);
+
+    vector<ld> queries(500 * dim), scores(500);
+    for (auto &x : queries) {
+      x = dis(gen);
+    }
+    model.score_batch(queries.data(), 500, dim, scores.data(), nullptr);
+
+    ll mismatches = 0;
+    vector<ll> hash_value(L);
+    for (ll i = 0; i < 500; ++i) {
+      ld expected = 0;
+      for (ll t = 0; t < T; ++t) {
+        tables.hash(queries.data() + i * dim, t, hash_value.data());
+        ll bucket = tables.getTables()[t].find(hash_value.data());
+        if (bucket >= 0) {
+          expected += estimators[t][bucket];
+        }
+      }
+      mismatches += expected != scores[i];
+    }
+    cout << "dim " << dim << ", L " << L << ": " << (mismatches == 0 ? "OK" : "FAILED") << endl;
+  }
+}
+
+// Trains on slices of the data in worker processes and merges their summaries, against the whole data hashed by one
+// process. One shard must give the model of train, more shards one within a small tolerance of the single process
+// HashAndEstimatePerHash result, at the tuned w and at a narrower one whose smaller buckets differ more between shards
+void testShardedTraining() {
+  mt19937_64 gen(5);
+  normal_distribution<ld> cluster(0, 1);
+  uniform_real_distribution<ld> noise(-10, 10);
+  auto generate = [&](ll n) {
+    vector<ld> rows;
+    for (ll i = 0; i < n; ++i) {
+      ld center = i % 2 == 0 ? -4 : 4;
+      for (int d = 0; d < 3; ++d) {
+        rows.push_back(i % 20 == 0 ? noise(gen) : center + cluster(gen));
+      }
+    }
+    return rows;
+  };
+  ll n = 20000, queries = 2000;
+  vector<ld> rows = generate(n), queryRows = generate(queries);
+  vector<vector<ld>> data;
+  for (ll i = 0; i < n; ++i) {
+    data.emplace_back(rows.begin() + i * 3, rows.begin() + (i + 1) * 3);
+  }
+
+  LSHAD<> reference;
+  reference.setSeed(5);
+  reference.train(data, 0.05);
+  ld tunedW = reference.getTuningReport().w;
+
+  // Every worker process summarizes its slice into a file of its own, then the summaries are merged
+  auto trainSharded = [&](ll shards, ld w, LSHAD<> &merged) {
+    vector<pid_t> workers;
+    for (ll s = 0; s < shards; ++s) {
+      pid_t pid = fork();
+      if (pid == 0) {
+        vector<vector<ld>> slice(data.begin() + n * s / shards, data.begin() + n * (s + 1) / shards);
+        LSHAD<> worker;
+        worker.setSeed(5);
+        _exit(worker.summarizeShard(slice, w).save("shard-" + to_string(s) + ".lshad") ? 0 : 1);
+      }
+      workers.push_back(pid);
+    }
+    vector<ShardSummary<ld>> summaries(shards);
+    bool loaded = true;
+    for (ll s = 0; s < shards; ++s) {
+      int status = 0;
+      waitpid(workers[s], &status, 0);
+      loaded = loaded && WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+               summaries[s].load("shard-" + to_string(s) + ".lshad");
+    }
+    return loaded && merged.mergeShards(summaries, 0.05);
+  };
+
+  vector<ld> expected(queries), actual(queries);
+  LSHAD<> single;
+  bool passed = trainSharded(1, tunedW, single);
+  if (passed) {
+    reference.score_batch(queryRows.data(), queries, 3, expected.data(), nullptr);
+    single.score_batch(queryRows.data(), queries, 3, actual.data(), nullptr);
+    passed = expected == actual && single.getFrozenModel()->getThreshold() == reference.getFrozenModel()->getThreshold();
+  }
+  cout << "1 shard, same model as train: " << (passed ? "yes" : "no") << endl;
+
+  for (ld w : {tunedW, tunedW / 8}) {
+    HashTables<ld> tables(4, 50, w, 3, 1, 5);
+    tables.insertBatch(rows.data(), n);
+    BucketEstimators estimators = tables.estimatePerHash();
+    FrozenLSHADModel<ld> model(tables, estimators, 0);
+    vector<ld> trainingScores(n);
+    model.score_batch(rows.data(), n, 3, trainingScores.data(), nullptr);
+    nth_element(trainingScores.begin(), trainingScores.begin() + n / 20, trainingScores.end());
+    ld threshold = trainingScores[n / 20];
+    model.score_batch(queryRows.data(), queries, 3, expected.data(), nullptr);
+
+    LSHAD<> merged;
+    if (!trainSharded(4, w, merged)) {
+      cout << "Shards not merged" << endl;
+      passed = false;
+      continue;
+    }
+    merged.score_batch(queryRows.data(), queries, 3, actual.data(), nullptr);
+
+    vector<ld> errors;
+    ll sameFlags = 0;
+    for (ll i = 0; i < queries; ++i) {
+      errors.push_back(fabsl(actual[i] - expected[i]) / max(expected[i], (ld) 1e-9));
+      sameFlags += (expected[i] <= threshold) == (actual[i] <= merged.getFrozenModel()->getThreshold());
+    }
+    sort(errors.begin(), errors.end());
+    ld median = errors[queries / 2], p90 = errors[queries * 9 / 10];
+    ld agreement = (ld) sameFlags / queries;
+    cout << "4 shards, w " << w << ": threshold " << merged.getFrozenModel()->getThreshold() << " (single process "
+         << threshold << "), relative score error median " << median << " p90 " << p90 << ", same flags "
+         << agreement * 100 << "%" << endl;
+    passed = passed && median < 0.05 && agreement > 0.97;
+  }
+
+  // A merged model holds no points to update, and summaries with a bad shape or negative counts are not loaded
+  LSHAD<> merged;
+  bool rejected = trainSharded(1, tunedW, merged) && !merged.update(data);
+  ifstream file("shard-0.lshad", ios::binary);
+  string bytes((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+  ShardHeader header;
+  memcpy(&header, bytes.data(), sizeof(header));
+  auto rejects = [&](size_t offset, int64_t value) {
+    string corrupt = bytes;
+    memcpy(&corrupt[offset], &value, sizeof(value));
+    ofstream("corrupt-shard.lshad", ios::binary | ios::trunc).write(corrupt.data(), corrupt.size());
+    ShardSummary<ld> summary;
+    return !summary.load("corrupt-shard.lshad");
+  };
+  int64_t buckets;
+  memcpy(&buckets, bytes.data() + sizeof(header), sizeof(buckets));
+  size_t sizes = sizeof(header) + sizeof(buckets) + buckets * header.L * sizeof(ll);
+  rejected = rejected && rejects(offsetof(ShardHeader, dim), 0) && rejects(offsetof(ShardHeader, points), -1) &&
+             rejects(sizes, -1) && rejects(sizes + buckets * sizeof(ll), -1) &&
+             rejects(offsetof(ShardHeader, L), 1LL << 40) && rejects(offsetof(ShardHeader, T), 1LL << 40) &&
+             rejects(offsetof(ShardHeader, dim), 1LL << 40) && rejects(offsetof(ShardHeader, dim), 1LL << 31) &&
+             rejects(sizeof(header), buckets + 1);
+  cout << "Merged model update and corrupt summaries rejected: " << (rejected ? "yes" : "no") << endl;
+  passed = passed && rejected;
+  cout << (passed ? "OK" : "FAILED") << endl;
+}
+
+// Resident memory of the process in kilobytes
+ll residentKilobytes() {
+  ifstream statm("/proc/self/statm");
+  ll pages = 0, resident = 0;
+  statm >> pages >> resident;
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Soak test of a windowed model: 30 simulated days of hourly batches drifting away from the training data
+// The model size and the resident memory should stay flat once the window is full
+void benchmarkWindowSoak() {
+  ll window = 2000;
+  ll batch = 100;
+
+  vector<vector<ld>> data;
+  for (int i = 0; i < 1000; ++i) {
+    data.push_back(generatePointInRange(-10.0, 10.0));
+  }
+  LSHAD<> lshad;
+  lshad.setWindow(window);
+  lshad.train(data, 0.1);
+
+  for (int day = 1; day <= 30; ++day) {
+    auto start = chrono::high_resolution_clock::now();
+    for (int hour = 0; hour < 24; ++hour) {
+      ld drift = day + hour / (ld) 24;
+      vector<vector<ld>> points;
+      for (int i = 0; i < batch; ++i) {
+        points.push_back(generatePointInRange(-10.0 + drift, 10.0 + drift));
+      }
+      lshad.update(points);
+    }
+    auto end = chrono::high_resolution_clock::now();
+    cout << "Day " << day << ": model " << lshad.getFrozenModel()->bytes() << " bytes, resident "
+         << residentKilobytes() << " kB, threshold " << lshad.getFrozenModel()->getThreshold() << ", "
+         << chrono::duration<double, milli>(end - start).count() / 24 << " ms per update" << endl;
+  }
 }
 
 int main() {
   // testHashTables();
   // testLSHADHyperparametersAutotuning();
   // testEstPerHash();
+  // testNumericTypesAgree();
+  // testSampledTuning();
+  // benchmarkConcurrentScoring();
+  // testModelSaveAndLoad();
+  // testStreamingTraining();
+  // testOnlineUpdate();
+  // testUpdateWhileScoring();
+  // benchmarkWindowSoak();
+  // testMultiProbe();
+  // testShapeTuning();
+  // testSparseInput();
+  // testSeededProjections();
+  // testSpecializedKernels();
+  // testShardedTraining();
   LSHAD lshad;
 
   testLSHATrain(lshad);